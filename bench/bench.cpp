@@ -0,0 +1,356 @@
+//
+//  bench.cpp
+//  OpenLung
+//
+//  Created by Felix Kratz on 16.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+// This is the benchmark driver for scaling studies: it generates symmetric
+// binary trees of -min-gen- to -max-gen- generations and measures every
+// branch update and history mode on them. Every result is one line of CSV
+// (or one object of JSON) with the steps per second, the nanoseconds per
+// branch and step, the peak resident memory of the run and the bytes the
+// history took, so the results of two builds can be compared directly.
+//
+// Run it with "make bench" or "make bench BENCH_ARGS='--max-gen 20 --format json'",
+// see usage() for all options.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "branchScaleModel.h"
+#include "lungScaleModel.h"
+#include "treeGenerator.h"
+
+struct BenchOptions {
+    int minGenerations = 10;
+    int maxGenerations = 25;
+    // The number of steps of a run is chosen so that a run does about this
+    // many branch updates, within [minSteps, maxSteps]
+    double work = 2e8;
+    int minSteps = 10;
+    int maxSteps = 100000;
+    int repeat = 1;
+    std::vector<int> threads;
+    // -level- is the layer by layer threaded update the model uses with
+    // threading, see levelSynchronousUpdateBranches()
+    std::vector<std::string> modes = {"serial", "level", "soa", "frontier", "history"};
+    // Runs that would need more memory than this are skipped
+    double memoryLimit = 0;
+    std::string format = "csv";
+    std::string out;
+    std::string tmpDir = "/tmp";
+};
+
+struct BenchResult {
+    int generations;
+    size_t branches;
+    std::string mode;
+    int threads;
+    std::string history;
+    int steps;
+    double seconds;
+    double stepsPerSecond;
+    double nsPerBranchStep;
+    size_t peakRSS;
+    size_t historyBytes;
+    double P;
+};
+
+// The peak resident memory can be reset on Linux, so every run gets its own peak
+static void resetPeakRSS() {
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    if (clearRefs) clearRefs << "5";
+}
+
+static size_t peakRSS() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+        if (line.compare(0, 6, "VmHWM:") == 0) return size_t(atoll(line.c_str() + 6)) * 1024;
+    // Not on Linux, this is the peak of the whole process
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return size_t(usage.ru_maxrss);
+#else
+    return size_t(usage.ru_maxrss) * 1024;
+#endif
+}
+
+static double physicalMemory() {
+    long pages = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGE_SIZE);
+    return pages > 0 && pageSize > 0 ? double(pages) * pageSize : 0;
+}
+
+static std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> values;
+    std::stringstream stream(list);
+    std::string value;
+    while (std::getline(stream, value, ',')) if (!value.empty()) values.push_back(value);
+    return values;
+}
+
+static void usage() {
+    std::cout << "Usage: bench [options]" << std::endl
+              << "  --min-gen N        smallest tree, in generations (default 10)" << std::endl
+              << "  --max-gen N        biggest tree, in generations (default 25)" << std::endl
+              << "  --work N           branch updates per run, sets the number of steps (default 2e8)" << std::endl
+              << "  --min-steps N      (default 10)" << std::endl
+              << "  --max-steps N      (default 100000)" << std::endl
+              << "  --repeat N         runs per measurement, the fastest one is reported (default 1)" << std::endl
+              << "  --threads a,b,...  thread counts of the level and soa modes (default 1, 2, 4, ... up to the cores)" << std::endl
+              << "  --modes a,b,...    serial, level, soa, frontier, history (default all)" << std::endl
+              << "  --memory-limit N   skip runs that need more bytes (default 80% of the physical memory)" << std::endl
+              << "  --format csv|json  (default csv)" << std::endl
+              << "  --out FILE         write the results to FILE instead of stdout" << std::endl
+              << "  --tmp-dir DIR      for the structure and history files (default /tmp)" << std::endl;
+}
+
+static bool parseOptions(int argc, const char* argv[], BenchOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") { usage(); exit(0); }
+        if (i + 1 >= argc) {
+            std::cout << "ERROR: " << arg << " needs a value" << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--min-gen") options.minGenerations = atoi(value.c_str());
+        else if (arg == "--max-gen") options.maxGenerations = atoi(value.c_str());
+        else if (arg == "--work") options.work = atof(value.c_str());
+        else if (arg == "--min-steps") options.minSteps = atoi(value.c_str());
+        else if (arg == "--max-steps") options.maxSteps = atoi(value.c_str());
+        else if (arg == "--repeat") options.repeat = std::max(1, atoi(value.c_str()));
+        else if (arg == "--threads") { options.threads.clear(); for (auto& t : split(value)) options.threads.push_back(atoi(t.c_str())); }
+        else if (arg == "--modes") options.modes = split(value);
+        else if (arg == "--memory-limit") options.memoryLimit = atof(value.c_str());
+        else if (arg == "--format") options.format = value;
+        else if (arg == "--out") options.out = value;
+        else if (arg == "--tmp-dir") options.tmpDir = value;
+        else {
+            std::cout << "ERROR: Unknown option " << arg << std::endl;
+            usage();
+            return false;
+        }
+    }
+    if (options.format != "csv" && options.format != "json") {
+        std::cout << "ERROR: Unknown format " << options.format << std::endl;
+        return false;
+    }
+    // The thread pool never starts more threads than there are cores, so
+    // bigger counts would only measure the same run again
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+    if (options.threads.empty()) {
+        for (int t = 1; t < cores; t *= 2) options.threads.push_back(t);
+        options.threads.push_back(cores);
+    }
+    for (auto& threads : options.threads) {
+        if (threads > cores) std::cerr << "WARNING: Only " << cores << " cores, measuring " << cores << " instead of " << threads << " threads" << std::endl;
+        threads = std::max(1, std::min(threads, cores));
+    }
+    std::sort(options.threads.begin(), options.threads.end());
+    options.threads.erase(std::unique(options.threads.begin(), options.threads.end()), options.threads.end());
+    if (options.memoryLimit <= 0) options.memoryLimit = 0.8 * physicalMemory();
+    return true;
+}
+
+class Bench {
+public:
+    Bench(BenchOptions options) : options(options) {};
+
+    void run() {
+        for (int generations = options.minGenerations; generations <= options.maxGenerations; generations++) {
+            size_t branches = (size_t(1) << generations) - 1;
+            // The branches, their connectivity, the scratch of the update and
+            // the tables of the generator
+            double bytes = double(branches) * (sizeof(BinaryTreeLungBranch) + sizeof(BranchParameters) + 64);
+            if (options.memoryLimit > 0 && bytes > options.memoryLimit) {
+                std::cerr << "Skipping " << generations << " generations, they need about " << bytes / (1 << 20) << " MB" << std::endl;
+                continue;
+            }
+            if (!generateTree(generations)) return;
+
+            int steps = int(std::min<double>(options.maxSteps, std::max<double>(options.minSteps, options.work / branches)));
+            for (auto& mode : options.modes) {
+                if (mode == "serial") measure(generations, mode, 1, "none", steps);
+                else if (mode == "frontier") measure(generations, mode, 1, "none", steps);
+                else if (mode == "soa") for (int threads : options.threads) measure(generations, mode, threads, "none", steps);
+                else if (mode == "level") {
+                    // With one thread the lung uses the serial update, which the serial mode measures already
+                    bool measured = false;
+                    for (int threads : options.threads) if (threads > 1) { measure(generations, mode, threads, "none", steps); measured = true; }
+                    if (!measured) std::cerr << "Skipping the level mode, it needs more than one thread" << std::endl;
+                }
+                else if (mode == "history") for (auto& history : {"lung", "detailed", "delta", "stream"}) measure(generations, "serial", 1, history, steps);
+                else std::cerr << "Unknown mode " << mode << std::endl;
+            }
+            remove(structurePath().c_str());
+        }
+    };
+
+    const std::vector<BenchResult>& getResults() const { return results; };
+
+private:
+    BenchOptions options;
+    std::vector<BenchResult> results;
+
+    GlobalBranchParameters globalPrm = {.zeta = 1e5};
+
+    std::string structurePath() const { return options.tmpDir + "/lung_bench_" + std::to_string(getpid()) + ".tree"; };
+    std::string historyPath() const { return options.tmpDir + "/lung_bench_" + std::to_string(getpid()) + ".hist"; };
+
+    ExternalParameters externalParameters(size_t branches) const {
+        ExternalParameters prm;
+        prm.dt = 1e-3;
+        prm.P_init = 0;
+        prm.P_ip_init = -0.5;
+        prm.V_ip_init = 1;
+        prm.Omega = 1;
+        prm.N_branches = int(branches);
+        return prm;
+    };
+
+    // The tree is generated once per size and written to a structure file,
+    // every run loads it from there, so the memory of the generator is not
+    // part of the measurements
+    bool generateTree(int generations) {
+        BranchParameters root = BranchParameters();
+        root.V = 150;
+        root.isStatic = true;
+        GenerationParameters generation;
+        generation.R = {1, 0.1};
+        generation.L = {1, 0.1};
+        generation.T = {0.1, 0};
+        generation.P_th = {0.3, 0.1};
+        TreeGenerator generator(root, std::vector<GenerationParameters>(generations - 1, generation), generations);
+        generator.useThreading(std::max(1u, std::thread::hardware_concurrency()));
+
+        BinaryTreeLung lung(globalPrm, externalParameters(size_t(1) << generations));
+        generator.generate(lung);
+        return lung.writeStructureToFile(structurePath().c_str());
+    };
+
+    void measure(int generations, const std::string& mode, int threads, const std::string& history, int steps) {
+        size_t branches = (size_t(1) << generations) - 1;
+        size_t historyRecord = branches * sizeof(BranchParameters);
+        // A detailed history of every step of a big tree does not fit, it is
+        // recorded four times per run instead
+        int detailedRate = std::max(1, steps / 4);
+        if ((history == "detailed" || history == "stream") && double(historyRecord) * (steps / detailedRate) > options.memoryLimit / 2) {
+            std::cerr << "Skipping the " << history << " history of " << generations << " generations" << std::endl;
+            return;
+        }
+
+        BenchResult best;
+        for (int r = 0; r < options.repeat; r++) {
+            BinaryTreeLung lung(globalPrm, externalParameters(branches));
+            if (!lung.readStructureFromFile(structurePath().c_str())) return;
+            if (mode == "level" || mode == "soa") lung.useThreading(threads);
+            if (mode == "soa") lung.useStructureOfArrays();
+            if (mode == "frontier") lung.useFrontierStepping();
+            if (history == "lung") lung.trackHistory(1);
+            else if (history == "detailed") lung.trackHistory(detailedRate, true);
+            else if (history == "delta") lung.trackDeltaHistory(1);
+            else if (history == "stream") lung.streamHistory(historyPath(), detailedRate, true);
+
+            // The volume of the thoraxic cavity of the example
+            auto V_ip = [](int step) { return 1 + 100 * (1 - exp(-step * 1e-3)); };
+            resetPeakRSS();
+            auto start = std::chrono::steady_clock::now();
+            lung.run(steps, V_ip);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            BenchResult result;
+            result.generations = generations;
+            result.branches = branches;
+            result.mode = mode;
+            result.threads = threads;
+            result.history = history;
+            result.steps = steps;
+            result.seconds = seconds;
+            result.stepsPerSecond = steps / seconds;
+            result.nsPerBranchStep = seconds * 1e9 / (double(steps) * branches);
+            result.historyBytes = historyBytes(lung, history);
+            result.peakRSS = peakRSS();
+            result.P = lung._getLungParams()->P;
+            if (r == 0 || result.seconds < best.seconds) best = result;
+        }
+        remove(historyPath().c_str());
+        results.push_back(best);
+        std::cerr << generations << " generations, " << mode << ", " << threads << " threads, " << history << " history: "
+                  << best.nsPerBranchStep << " ns per branch and step" << std::endl;
+    };
+
+    size_t historyBytes(BinaryTreeLung& lung, const std::string& history) {
+        if (history == "stream") {
+            lung.closeHistory();
+            struct stat info;
+            return stat(historyPath().c_str(), &info) == 0 ? size_t(info.st_size) : 0;
+        }
+        std::vector<HistoryPair>* records = lung._getHistory();
+        size_t bytes = records->capacity() * sizeof(HistoryPair);
+        for (auto& record : *records) bytes += record.second.capacity() * sizeof(BranchParameters);
+        if (history == "delta") bytes += lung._getDeltaHistory()->getBytes();
+        return bytes;
+    };
+};
+
+static void writeCSV(std::ostream& out, const std::vector<BenchResult>& results) {
+    out << "generations,branches,mode,threads,history,steps,seconds,steps_per_second,ns_per_branch_step,peak_rss_bytes,history_bytes,P" << std::endl;
+    char line[512];
+    for (auto& r : results) {
+        snprintf(line, sizeof(line), "%d,%zu,%s,%d,%s,%d,%.6f,%.3f,%.4f,%zu,%zu,%.17g", r.generations, r.branches, r.mode.c_str(), r.threads,
+                 r.history.c_str(), r.steps, r.seconds, r.stepsPerSecond, r.nsPerBranchStep, r.peakRSS, r.historyBytes, r.P);
+        out << line << std::endl;
+    }
+}
+
+static void writeJSON(std::ostream& out, const std::vector<BenchResult>& results) {
+    out << "{\"cores\":" << std::thread::hardware_concurrency() << ",\"scalar\":\"" << (sizeof(BranchParameters::scalar_type) == 4 ? "float" : "double")
+        << "\",\"results\":[" << std::endl;
+    char line[640];
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        snprintf(line, sizeof(line), "{\"generations\":%d,\"branches\":%zu,\"mode\":\"%s\",\"threads\":%d,\"history\":\"%s\",\"steps\":%d,\"seconds\":%.6f,"
+                 "\"steps_per_second\":%.3f,\"ns_per_branch_step\":%.4f,\"peak_rss_bytes\":%zu,\"history_bytes\":%zu,\"P\":%.17g}",
+                 r.generations, r.branches, r.mode.c_str(), r.threads, r.history.c_str(), r.steps, r.seconds, r.stepsPerSecond,
+                 r.nsPerBranchStep, r.peakRSS, r.historyBytes, r.P);
+        out << line << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    out << "]}" << std::endl;
+}
+
+int main(int argc, const char* argv[]) {
+    BenchOptions options;
+    if (!parseOptions(argc, argv, options)) return 1;
+
+    Bench bench(options);
+    bench.run();
+
+    std::ofstream file;
+    if (!options.out.empty()) {
+        file.open(options.out);
+        if (!file) {
+            std::cout << "ERROR: Could not open " << options.out << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& out = options.out.empty() ? std::cout : file;
+    if (options.format == "json") writeJSON(out, bench.getResults());
+    else writeCSV(out, bench.getResults());
+    return 0;
+}
@@ -0,0 +1,388 @@
+//
+//  check.cpp
+//  OpenLung
+//
+//  Created by Felix Kratz on 17.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+// This checks that the branch update routines of the binary tree lung give
+// the same results bit for bit as the serial updateBranches(): every path
+// runs the same random tree with the same V_ip waveform and the lung and
+// all branches are compared at a few steps along the way. The reordered
+// layouts are compared branch by branch through their new indices, the
+// ensemble and the compressed tree (on a symmetric tree) only by the lung
+// parameters and the checkpoint by continuing a run from the middle.
+// advance() with a tolerance only has to stay within it. The other ways of
+// recording the history have to give the records of the detailed history
+// and the layer observables the sums over its branches. The telemetry is
+// read back from the shared memory and has to give the lung parameters.
+//
+// The threaded paths only run threaded on a machine with more than one core,
+// the thread pool never starts more threads than there are cores.
+//
+// Run it with "make check", it exits with 1 if any path differs. The paths
+// agree with any optimization flags (e.g. "-O2 -march=native", where the
+// compiler could contract a * b + c differently in every path) except for
+// -ffast-math, which allows the compiler to rearrange the arithmetic of
+// every path in its own way, so "make check" turns it off.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "branchScaleModel.h"
+#include "lungScaleModel.h"
+#include "ensemble.h"
+#include "layerObservables.h"
+#include "treeGenerator.h"
+
+static const int generations = 12;
+static const int steps = 1200;
+// The lung and all branches are compared every -sampleRate- steps
+static const int sampleRate = 300;
+
+static GlobalBranchParameters globalPrm = {.zeta = 1e5};
+static ExternalParameters externPrm = {.dt = 1e-3, .P_init = 0, .P_ip_init = -0.5, .V_ip_init = 1, .Omega = 1, .N_branches = 0};
+
+static double V_ip(int step) { return 1 + 100 * (1 - exp(-step * 1e-3)); }
+
+// Random thresholds and geometries, so the branches open one after another
+static TreeGenerator treeGenerator(bool symmetric = false) {
+    BranchParameters root = {.R = 0, .L = 0, .T = 0, .V = 150., .P_th = 0, .layer_ID = 0, .isStatic = true};
+    std::vector<GenerationParameters> generationPrm(generations - 1);
+    for (int g = 0; g < generations - 1; g++) {
+        double spread = symmetric ? 0 : 0.1;
+        generationPrm[g].R = {1.0, spread};
+        generationPrm[g].L = {1.0, spread};
+        generationPrm[g].T = {0.1, 0};
+        generationPrm[g].P_th = {0.1 + 0.02 * g, symmetric ? 0 : 0.05};
+    }
+    return TreeGenerator(root, generationPrm, 7);
+}
+
+// The branches of a compressed tree can not be compared with the full tree,
+// so only its lung parameters are recorded
+static std::vector<HistoryPair> runLung(const std::function<void(BinaryTreeLung&)>& setup, bool symmetric = false, bool compressed = false) {
+    BinaryTreeLung lung(globalPrm, externPrm);
+    if (compressed) treeGenerator(symmetric).generateCompressed(lung);
+    else treeGenerator(symmetric).generate(lung);
+    lung.trackHistory(sampleRate, !compressed);
+    setup(lung);
+    lung.run(steps, V_ip);
+    return *lung._getHistory();
+}
+
+// Runs the first half of the steps, writes a checkpoint and runs the second
+// half in a new lung restored from it. -setup- is used for both lungs, the
+// second one runs a few steps of its own tree before it reads the checkpoint.
+static std::vector<HistoryPair> runRestoredLung(const std::function<void(BinaryTreeLung&)>& setup) {
+    std::string path = "/tmp/lung_check_" + std::to_string(getpid()) + ".ckpt";
+    BinaryTreeLung first(globalPrm, externPrm);
+    treeGenerator().generate(first);
+    first.trackHistory(sampleRate, true);
+    setup(first);
+    first.run(steps / 2, V_ip);
+    if (!first.writeCheckpoint(path.c_str())) return {};
+
+    BinaryTreeLung second(globalPrm, externPrm);
+    treeGenerator(true).generate(second);
+    setup(second);
+    second.run(10, V_ip);
+    second.trackHistory(sampleRate, true);
+    bool restored = second.readCheckpoint(path.c_str());
+    remove(path.c_str());
+    if (!restored) return {};
+    second.run(steps - steps / 2, V_ip);
+
+    std::vector<HistoryPair> history = *first._getHistory();
+    history.insert(history.end(), second._getHistory()->begin(), second._getHistory()->end());
+    return history;
+}
+
+// Runs the steps with advance() instead of run()
+static std::vector<HistoryPair> runAdvancedLung(double tolerance) {
+    BinaryTreeLung lung(globalPrm, externPrm);
+    treeGenerator().generate(lung);
+    lung.trackHistory(sampleRate, true);
+    lung.advance(steps, V_ip, tolerance);
+    return *lung._getHistory();
+}
+
+// Records the steps in the delta history and reconstructs the branches of
+// every record with getBranchHistory(). A short -keyframeInterval- has
+// records of both kinds.
+static std::vector<HistoryPair> runDeltaLung(int keyframeInterval) {
+    BinaryTreeLung lung(globalPrm, externPrm);
+    treeGenerator().generate(lung);
+    lung.trackDeltaHistory(sampleRate, keyframeInterval);
+    lung.run(steps, V_ip);
+    std::vector<HistoryPair> history = *lung._getHistory();
+    for (size_t r = 0; r < history.size(); r++)
+        if (!lung.getBranchHistory(int(r + 1) * sampleRate, history[r].second)) return {};
+    return history;
+}
+
+// Records the detailed history every -rate- steps on the background thread
+// of captureHistoryAsync(). -dropped- is the number of records that were
+// lost because all -slots- were taken.
+static std::vector<HistoryPair> runAsyncLung(int rate, int slots, HistoryBackPressure policy, size_t& dropped) {
+    BinaryTreeLung lung(globalPrm, externPrm);
+    treeGenerator().generate(lung);
+    lung.trackHistory(rate, true);
+    lung.captureHistoryAsync(true, slots, policy);
+    lung.run(steps, V_ip);
+    std::vector<HistoryPair> history = *lung._getHistory();
+    dropped = lung._getDroppedHistoryCount();
+    return history;
+}
+
+// Publishes the lung parameters every -sampleRate- steps into a telemetry
+// segment and reads them back with a TelemetryReader once the lung is done,
+// the last record with readLatest(). A record of the wrong step is left out.
+static std::vector<HistoryPair> runPublishedLung() {
+    std::string name = "/lung_check_" + std::to_string(getpid());
+    {
+        BinaryTreeLung lung(globalPrm, externPrm);
+        treeGenerator().generate(lung);
+        lung.publishTelemetry(name, sampleRate);
+        lung.run(steps, V_ip);
+    }
+    std::vector<HistoryPair> history;
+    TelemetryReader reader;
+    if (reader.open(name) && reader.isFinished()) {
+        TelemetryRecord record;
+        for (uint64_t k = reader.getOldestRecord(); k + 1 < reader.getPublishedCount(); k++)
+            if (reader.read(k, record) && record.step == int64_t(k + 1) * sampleRate) history.push_back({record.lungPrm, {}});
+        if (reader.readLatest(record) && record.step == steps) history.push_back({record.lungPrm, {}});
+    }
+    reader.close();
+    removeTelemetry(name);
+    return history;
+}
+
+// Every member of the ensemble is a copy of the same lung, so every member
+// has to give the results of the serial update. The ensemble only records
+// the lung parameters, the branches are compared after the last step.
+static std::vector<std::vector<HistoryPair>> runEnsemble(int members, int threads) {
+    BinaryTreeLung lung(globalPrm, externPrm);
+    treeGenerator().generate(lung);
+    BinaryTreeEnsemble ensemble(lung, members);
+    ensemble.trackHistory(sampleRate);
+    if (threads > 1) ensemble.useThreading(threads, 64);
+    std::vector<double> V_ip_m(members);
+    for (int step = 0; step < steps; step++) {
+        std::fill(V_ip_m.begin(), V_ip_m.end(), V_ip(step));
+        ensemble.timeStep(V_ip_m.data());
+    }
+
+    std::vector<std::vector<HistoryPair>> histories(members);
+    const std::vector<LungParameters>& records = *ensemble._getHistory();
+    for (size_t r = 0; r < records.size(); r++) histories[r % members].push_back({records[r], {}});
+    for (int m = 0; m < members && !histories[m].empty(); m++) {
+        std::vector<BranchParameters>& branchPrm = histories[m].back().second;
+        for (int i = 0; i < ensemble.getBranchCount(); i++) {
+            branchPrm.push_back(*lung._getBranch(i)->_getBranchParameters());
+            branchPrm.back().V = ensemble._getVolume(m, i);
+            branchPrm.back().isOpen = ensemble._isOpen(m, i);
+        }
+    }
+    return histories;
+}
+
+// The index of the branch of the reference that is compared with branch i
+// of the path, see the reordered layouts
+typedef std::function<int(int)> BranchMap;
+
+static bool same(double a, double b) { return memcmp(&a, &b, sizeof(double)) == 0; }
+
+static int failures = 0;
+
+static void compare(const std::string& name, const std::vector<HistoryPair>& reference, const std::vector<HistoryPair>& history, const BranchMap& map = nullptr) {
+    std::string error;
+    if (history.size() != reference.size()) error = "recorded " + std::to_string(history.size()) + " instead of " + std::to_string(reference.size()) + " steps";
+    for (size_t r = 0; r < history.size() && r < reference.size() && error.empty(); r++) {
+        const LungParameters& a = reference[r].first;
+        const LungParameters& b = history[r].first;
+        if (!same(a.P, b.P) || !same(a.V, b.V) || !same(a.q, b.q) || !same(a.P_ip, b.P_ip) || !same(a.V_ip, b.V_ip)) {
+            char buffer[256];
+            snprintf(buffer, sizeof(buffer), "P %.17g and V %.17g instead of %.17g and %.17g in record %zu", b.P, b.V, a.P, a.V, r);
+            error = buffer;
+            break;
+        }
+        const std::vector<BranchParameters>& branchesA = reference[r].second;
+        const std::vector<BranchParameters>& branchesB = history[r].second;
+        // Only the lung parameters are recorded
+        if (branchesB.empty()) continue;
+        if (branchesA.size() != branchesB.size()) { error = "different number of branches"; break; }
+        for (size_t i = 0; i < branchesB.size(); i++) {
+            const BranchParameters& prmA = branchesA[map ? map(int(i)) : i];
+            const BranchParameters& prmB = branchesB[i];
+            if (same(prmA.V, prmB.V) && prmA.isOpen == prmB.isOpen) continue;
+            error = "branch " + std::to_string(i) + " differs in record " + std::to_string(r);
+            break;
+        }
+    }
+    if (!error.empty()) failures++;
+    printf("%-34s %s%s\n", name.c_str(), error.empty() ? "ok" : "FAILED: ", error.c_str());
+}
+
+// Like compare(), but P and V of the lung only have to be within -tolerance-
+static void compareWithin(const std::string& name, const std::vector<HistoryPair>& reference, const std::vector<HistoryPair>& history, double tolerance) {
+    std::string error;
+    if (history.size() != reference.size()) error = "recorded " + std::to_string(history.size()) + " instead of " + std::to_string(reference.size()) + " steps";
+    double errorOfP = 0, errorOfV = 0;
+    for (size_t r = 0; r < history.size() && r < reference.size(); r++) {
+        errorOfP = std::max(errorOfP, fabs(history[r].first.P - reference[r].first.P));
+        errorOfV = std::max(errorOfV, fabs(history[r].first.V - reference[r].first.V));
+    }
+    if (error.empty() && (errorOfP > tolerance || errorOfV > tolerance)) {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "P is off by %.3g and V by %.3g, more than %g", errorOfP, errorOfV, tolerance);
+        error = buffer;
+    }
+    if (!error.empty()) failures++;
+    printf("%-34s %s%s\n", name.c_str(), error.empty() ? "ok" : "FAILED: ", error.c_str());
+}
+
+// Runs the steps with the layer observables of layerObservables.h and
+// compares them with the sums over the branches of every record of the
+// detailed -reference-: the volume and the open fraction of every layer, and
+// the openings of all steps so far with the branches opened since the start.
+static void compareObservables(const std::string& name, const std::vector<HistoryPair>& reference, const std::function<void(BinaryTreeLung&)>& setup) {
+    BinaryTreeLung lung(globalPrm, externPrm);
+    treeGenerator().generate(lung);
+    lung.addObservable(std::make_unique<LayerVolume>());
+    lung.addObservable(std::make_unique<LayerOpenFraction>());
+    lung.addObservable(std::make_unique<LayerOpenings>());
+    lung.sampleObservables(1);
+    setup(lung);
+    size_t branchCount = reference.empty() ? 0 : reference[0].second.size();
+    std::vector<double> openAtStart(generations, 0);
+    for (size_t i = 0; i < branchCount; i++) {
+        const BranchParameters& prm = *lung._getBranch(int(i))->_getBranchParameters();
+        openAtStart[prm.layer_ID] += prm.isOpen;
+    }
+    lung.run(steps, V_ip);
+
+    const ObservableSeries& series = *lung._getObservableSeries();
+    std::string error;
+    if (series.size() != size_t(steps)) error = "sampled " + std::to_string(series.size()) + " instead of " + std::to_string(steps) + " steps";
+    for (size_t r = 0; r < reference.size() && error.empty(); r++) {
+        std::vector<ExactSum> V(generations);
+        std::vector<double> open(generations, 0), count(generations, 0);
+        for (const BranchParameters& prm : reference[r].second) {
+            V[prm.layer_ID].add(prm.V);
+            open[prm.layer_ID] += prm.isOpen;
+            count[prm.layer_ID]++;
+        }
+        size_t row = (r + 1) * sampleRate - 1;
+        for (int l = 0; l < generations && error.empty(); l++) {
+            std::string layer = ".layer" + std::to_string(l);
+            double openings = 0;
+            for (size_t k = 0; k <= row; k++) openings += series.at(k, series.column("openings" + layer));
+            if (!same(series.at(row, series.column("V" + layer)), V[l].get())) error = "V";
+            else if (!same(series.at(row, series.column("openFraction" + layer)), count[l] ? open[l] / count[l] : 0)) error = "openFraction";
+            else if (openings != open[l] - openAtStart[l]) error = "openings";
+            if (!error.empty()) error += " of layer " + std::to_string(l) + " differs in record " + std::to_string(r);
+        }
+    }
+    if (!error.empty()) failures++;
+    printf("%-34s %s%s\n", name.c_str(), error.empty() ? "ok" : "FAILED: ", error.c_str());
+}
+
+int main() {
+    std::vector<HistoryPair> reference = runLung([](BinaryTreeLung&) {});
+    printf("%d generations, %d steps, P = %.17g\n", generations, steps, reference.back().first.P);
+
+    if (std::thread::hardware_concurrency() < 2) printf("Only one core, the threaded paths run on one thread\n");
+
+    compare("level synchronous", reference, runLung([](BinaryTreeLung& lung) { lung.useThreading(4, 64); }));
+    compare("structure of arrays", reference, runLung([](BinaryTreeLung& lung) { lung.useStructureOfArrays(); }));
+    compare("structure of arrays threaded", reference, runLung([](BinaryTreeLung& lung) { lung.useStructureOfArrays(); lung.useThreading(4, 64); }));
+    compare("frontier", reference, runLung([](BinaryTreeLung& lung) { lung.useFrontierStepping(); }));
+    compare("frontier threaded", reference, runLung([](BinaryTreeLung& lung) { lung.useFrontierStepping(); lung.useThreading(4, 64); }));
+
+    // Branch i of a reordered lung is branch oldIndex[i] of the reference
+    const std::pair<const char*, BranchLayout> layouts[] = {
+        {"reordered depth first", BranchLayout::DepthFirst},
+        {"reordered breadth first", BranchLayout::BreadthFirst},
+        {"reordered van Emde Boas", BranchLayout::VanEmdeBoas}};
+    for (auto& layout : layouts) {
+        std::vector<int32_t> remap;
+        std::vector<HistoryPair> history = runLung([&](BinaryTreeLung& lung) { remap = lung.reorderBranches(layout.second); });
+        std::vector<int> oldIndex(remap.size());
+        for (size_t i = 0; i < remap.size(); i++) oldIndex[remap[i]] = int(i);
+        compare(layout.first, reference, history, [&](int i) { return oldIndex[i]; });
+    }
+
+    compare("delta history", reference, runDeltaLung(2));
+    // The async history records often enough that all slots are taken at
+    // times. Which records are dropped depends on the background thread, the
+    // ones that were kept have to be records of the reference in their order.
+    // V_ip grows every step, so it tells the records apart.
+    {
+        const int rate = 10;
+        std::vector<HistoryPair> everyRate = runLung([&](BinaryTreeLung& lung) { lung.trackHistory(rate, true); });
+        size_t dropped = 0;
+        compare("async history", everyRate, runAsyncLung(rate, 1, HistoryBackPressure::Block, dropped));
+
+        std::vector<HistoryPair> history = runAsyncLung(rate, 1, HistoryBackPressure::Drop, dropped);
+        std::vector<HistoryPair> kept;
+        for (size_t k = 0, r = 0; k < history.size(); k++) {
+            while (r < everyRate.size() && !same(everyRate[r].first.V_ip, history[k].first.V_ip)) r++;
+            if (r < everyRate.size()) kept.push_back(everyRate[r++]);
+        }
+        if (history.size() + dropped != everyRate.size()) {
+            failures++;
+            printf("%-34s FAILED: %zu records kept and %zu dropped instead of %zu\n", "async history dropping", history.size(), dropped, everyRate.size());
+        } else compare("async history dropping", kept, history);
+    }
+
+    compareObservables("observables", reference, [](BinaryTreeLung&) {});
+    compareObservables("observables threaded", reference, [](BinaryTreeLung& lung) { lung.useThreading(4, 64); });
+    compareObservables("observables structure of arrays", reference, [](BinaryTreeLung& lung) { lung.useStructureOfArrays(); });
+    compareObservables("observables frontier", reference, [](BinaryTreeLung& lung) { lung.useFrontierStepping(); });
+    compare("telemetry", reference, runPublishedLung());
+
+    compare("advance", reference, runAdvancedLung(0));
+    for (double tolerance : {1e-4, 1e-2, 1e-1}) {
+        char name[64];
+        snprintf(name, sizeof(name), "advance within %g", tolerance);
+        compareWithin(name, reference, runAdvancedLung(tolerance), tolerance);
+    }
+
+    compare("checkpoint round trip", reference, runRestoredLung([](BinaryTreeLung&) {}));
+    compare("checkpoint structure of arrays", reference, runRestoredLung([](BinaryTreeLung& lung) { lung.useStructureOfArrays(); }));
+
+    for (int threads : {1, 4}) {
+        std::vector<std::vector<HistoryPair>> members = runEnsemble(3, threads);
+        for (size_t m = 0; m < members.size(); m++)
+            compare("ensemble member " + std::to_string(m) + (threads > 1 ? " threaded" : ""), reference, members[m]);
+    }
+
+    // Compression needs identical subtrees, so these run a symmetric tree
+    std::vector<HistoryPair> symmetric = runLung([](BinaryTreeLung&) {}, true);
+    compare("compressed", symmetric, runLung([](BinaryTreeLung&) {}, true, true));
+    compare("compressed structure of arrays", symmetric, runLung([](BinaryTreeLung& lung) { lung.useStructureOfArrays(); }, true, true));
+    // Compressed in the middle of the run, while the structure of arrays is current
+    {
+        BinaryTreeLung lung(globalPrm, externPrm);
+        treeGenerator(true).generate(lung);
+        lung.useStructureOfArrays();
+        lung.trackHistory(sampleRate, false);
+        lung.run(steps / 2, V_ip);
+        lung.compressBranches();
+        lung.run(steps - steps / 2, V_ip);
+        compare("compressed while running", symmetric, *lung._getHistory());
+    }
+    compare("compressed frontier", symmetric, runLung([](BinaryTreeLung& lung) { lung.useFrontierStepping(); }, true, true));
+
+    if (failures) printf("%d paths differ from the serial update\n", failures);
+    return failures ? 1 : 0;
+}
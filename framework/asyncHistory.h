@@ -0,0 +1,142 @@
+//
+//  asyncHistory.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 16.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "model_params.h"
+#include "threadPool.h"
+
+// What happens to a history record when the background thread falls behind
+// and all snapshot slots are full: Block waits for a free slot, Drop throws
+// the record away (and counts it) so the simulation never waits.
+enum class HistoryBackPressure { Block, Drop };
+
+// A copy of everything a history event needs. The branch vector is allocated
+// once and reused, it only grows if the number of branches grows.
+struct HistorySnapshot {
+    int timeStep = 0;
+    LungParameters lungPrm;
+    size_t branchCount = 0;
+    std::vector<BranchParameters> branchParams;
+};
+
+// This hands history snapshots from the simulation thread to a background
+// thread through a ring of preallocated slots. There is exactly one producer
+// (the simulation) and one consumer (the background thread), so the ring only
+// needs two counters and no locks. The consumer only sleeps on a condition
+// variable if there is nothing to do for a while.
+class AsyncHistory {
+public:
+    ~AsyncHistory() { stop(); };
+
+    bool isRunning() const { return consumer.joinable(); };
+    size_t getDroppedCount() const { return dropped; };
+
+    // Starts the background thread, -consume- is called on it for every
+    // published snapshot in order
+    void start(size_t slotCount, size_t branchCapacity, HistoryBackPressure policy, std::function<void(const HistorySnapshot&)> consume) {
+        stop();
+        slots.assign(slotCount > 0 ? slotCount : 1, HistorySnapshot());
+        for (auto& slot : slots) slot.branchParams.resize(branchCapacity);
+        this->policy = policy;
+        this->consume = consume;
+        head.store(0);
+        tail.store(0);
+        dropped = 0;
+        stopping.store(false);
+        consumer = std::thread(&AsyncHistory::consumerLoop, this);
+    };
+
+    // Returns the next free slot, or nullptr if the record has to be dropped.
+    // The slot has to be handed over with publish() before the next acquire().
+    inline HistorySnapshot* acquire(size_t branchCount) {
+        uint64_t next = head.load(std::memory_order_relaxed);
+        for (int i = 0; next - tail.load(std::memory_order_acquire) >= slots.size(); i++) {
+            if (policy == HistoryBackPressure::Drop) { dropped++; return nullptr; }
+            if (i < spinCount) LUNG_CPU_RELAX();
+            else std::this_thread::yield();
+        }
+        HistorySnapshot* slot = &slots[next % slots.size()];
+        if (slot->branchParams.size() < branchCount) slot->branchParams.resize(branchCount);
+        slot->branchCount = branchCount;
+        return slot;
+    };
+
+    inline void publish() {
+        head.fetch_add(1);
+        if (sleeping.load()) {
+            { std::lock_guard<std::mutex> lock(sleepMutex); }
+            sleepCondition.notify_one();
+        }
+    };
+
+    // Waits until the background thread has consumed everything published so
+    // far, call this before the results of the consumer are read
+    void flush() {
+        if (!isRunning()) return;
+        uint64_t published = head.load();
+        for (int i = 0; tail.load(std::memory_order_acquire) != published; i++) {
+            if (i < spinCount) LUNG_CPU_RELAX();
+            else std::this_thread::yield();
+        }
+    };
+
+    // Consumes the rest of the snapshots and stops the background thread
+    void stop() {
+        if (!isRunning()) return;
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping.store(true);
+        }
+        sleepCondition.notify_one();
+        consumer.join();
+        slots.clear();
+    };
+
+private:
+    static constexpr int spinCount = 1 << 10;
+
+    std::vector<HistorySnapshot> slots;
+    HistoryBackPressure policy = HistoryBackPressure::Block;
+    std::function<void(const HistorySnapshot&)> consume;
+    size_t dropped = 0;
+
+    // Number of snapshots published by the producer and consumed by the consumer
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+
+    std::thread consumer;
+    std::atomic<bool> sleeping{false};
+    std::atomic<bool> stopping{false};
+    std::mutex sleepMutex;
+    std::condition_variable sleepCondition;
+
+    void consumerLoop() {
+        uint64_t next = tail.load();
+        while (true) {
+            for (int i = 0; head.load(std::memory_order_acquire) == next; i++) {
+                if (stopping.load()) return;
+                if (i < spinCount) { LUNG_CPU_RELAX(); continue; }
+
+                // The simulation does not produce anything right now
+                std::unique_lock<std::mutex> lock(sleepMutex);
+                sleeping.store(true);
+                sleepCondition.wait(lock, [&] { return head.load() != next || stopping.load(); });
+                sleeping.store(false);
+            }
+            consume(slots[next % slots.size()]);
+            tail.store(++next, std::memory_order_release);
+        }
+    };
+};
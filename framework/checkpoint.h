@@ -0,0 +1,221 @@
+//
+//  checkpoint.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 16.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "structureFile.h"
+
+// This is the layout of a checkpoint file:
+//   [header]
+//   [structure] at -structureOffset-, a complete structure file (see
+//               structureFile.h) with the state of all branches
+//   [multiplicity] at -multiplicityOffset-, only for a compressed lung: the
+//               number of branches every branch stands for as uint64_t
+// The header holds the state of the lung itself.
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t lungRecordSize;
+    uint32_t externRecordSize;
+    uint32_t globalRecordSize;
+    int32_t timeSteps;
+    int32_t reserved;
+    // The number of history events before the checkpoint, see Lung::getHistoryCursor()
+    uint64_t historyCursor;
+    uint64_t structureOffset;
+    // 0 if the lung is not compressed
+    uint64_t multiplicityOffset;
+    LungParameters lungPrm;
+    ExternalParameters externPrm;
+    GlobalBranchParameters branchPrmGlobal;
+};
+
+static constexpr char checkpointFileMagic[8] = {'L', 'U', 'N', 'G', 'C', 'K', 'P', 'T'};
+static constexpr uint32_t checkpointFileVersion = 2;
+
+// Writes a checkpoint file, -branchAt(i)- has to return the parameters of branch i,
+// -multiplicity- is nullptr unless the lung is compressed.
+// The file is written under a temporary name and renamed at the end, so an
+// existing checkpoint is only replaced by a complete one.
+template <class F>
+bool writeCheckpointFile(const char* path, CheckpointHeader header, size_t branchCount, F&& branchAt, const IndexLists& connections, const uint64_t* multiplicity = nullptr) {
+    memcpy(header.magic, checkpointFileMagic, sizeof(header.magic));
+    header.version = checkpointFileVersion;
+    header.lungRecordSize = sizeof(LungParameters);
+    header.externRecordSize = sizeof(ExternalParameters);
+    header.globalRecordSize = sizeof(GlobalBranchParameters);
+    header.structureOffset = (sizeof(header) + 63) / 64 * 64;
+    header.multiplicityOffset = 0;
+
+    std::string temporary = std::string(path) + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file) {
+        std::cout << "ERROR: Could not open the checkpoint file " << temporary << std::endl;
+        return false;
+    }
+    const char zeros[64] = {};
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(zeros, 1, header.structureOffset - sizeof(header), file);
+    bool success = writeStructure(file, branchCount, branchAt, connections);
+    if (success && multiplicity) {
+        // The table goes behind the structure and the header is written again
+        // with its offset
+        long end = ftell(file);
+        header.multiplicityOffset = (uint64_t(end) + 63) / 64 * 64;
+        fwrite(zeros, 1, header.multiplicityOffset - end, file);
+        success = fwrite(multiplicity, sizeof(uint64_t), branchCount, file) == branchCount
+               && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    }
+    if (fclose(file) != 0) success = false;
+    if (success && rename(temporary.c_str(), path) != 0) success = false;
+    if (!success) {
+        std::cout << "ERROR: Could not write the checkpoint file " << path << std::endl;
+        remove(temporary.c_str());
+    }
+    return success;
+}
+
+// This gives access to a checkpoint file, the branch tables are used right
+// from the mapped file. One reader can restore any number of lungs, so many
+// runs can start from the same checkpoint without reading it again.
+class CheckpointReader {
+public:
+    bool open(const char* path) {
+        FILE* file = fopen(path, "rb");
+        if (!file) {
+            std::cout << "ERROR: Could not open the checkpoint file " << path << std::endl;
+            return false;
+        }
+        bool complete = fread(&header, sizeof(header), 1, file) == 1;
+        if (!complete || memcmp(header.magic, checkpointFileMagic, sizeof(header.magic)) != 0 || header.version != checkpointFileVersion
+            || header.lungRecordSize != sizeof(LungParameters) || header.externRecordSize != sizeof(ExternalParameters)
+            || header.globalRecordSize != sizeof(GlobalBranchParameters)) {
+            std::cout << "ERROR: " << path << " is not a checkpoint of this model" << std::endl;
+            fclose(file);
+            return false;
+        }
+        if (!structure.open(path, header.structureOffset)) {
+            fclose(file);
+            return false;
+        }
+        multiplicity.clear();
+        if (header.multiplicityOffset) {
+            multiplicity.resize(structure.size());
+            if (fseek(file, long(header.multiplicityOffset), SEEK_SET) != 0
+                || fread(multiplicity.data(), sizeof(uint64_t), multiplicity.size(), file) != multiplicity.size()) {
+                std::cout << "ERROR: The checkpoint " << path << " is incomplete" << std::endl;
+                fclose(file);
+                return false;
+            }
+        }
+        fclose(file);
+        return true;
+    };
+
+    const CheckpointHeader& getHeader() const { return header; };
+    const StructureReader& getStructure() const { return structure; };
+    // nullptr unless the checkpoint is of a compressed lung
+    const uint64_t* getMultiplicity() const { return multiplicity.empty() ? nullptr : multiplicity.data(); };
+
+private:
+    CheckpointHeader header;
+    StructureReader structure;
+    std::vector<uint64_t> multiplicity;
+};
+
+// The state of a lung, copied at a time step and written on a background
+// thread, see CheckpointWriter
+struct CheckpointSnapshot {
+    CheckpointHeader header;
+    std::vector<BranchParameters> branchParams;
+    IndexLists connections;
+    std::vector<uint64_t> multiplicity;
+};
+
+// This writes checkpoints on a background thread, so the time steps only pay
+// for copying the state. Only one checkpoint is written at a time: acquire()
+// waits until the last one is done, a lung that checkpoints faster than the
+// disk can take it is slowed down to the speed of the disk.
+class CheckpointWriter {
+public:
+    ~CheckpointWriter() { stop(); };
+
+    // Returns the snapshot to fill, publish() hands it to the background thread
+    CheckpointSnapshot* acquire() {
+        if (!worker.joinable()) worker = std::thread([this] { work(); });
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return !pending; });
+        return &snapshot;
+    };
+
+    void publish(std::string path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->path = path;
+        pending = true;
+        wake.notify_one();
+    };
+
+    // Waits until the last checkpoint is written
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return !pending; });
+    };
+
+    void stop() {
+        if (!worker.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            wake.notify_one();
+        }
+        worker.join();
+        stopping = false;
+    };
+
+    size_t getWrittenCount() const { return written.load(); };
+
+private:
+    CheckpointSnapshot snapshot;
+    std::string path;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool pending = false;
+    bool stopping = false;
+    std::atomic<size_t> written{0};
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return pending || stopping; });
+            if (pending) {
+                // The snapshot is not touched by the lung until -pending- is cleared
+                lock.unlock();
+                bool success = writeCheckpointFile(path.c_str(), snapshot.header, snapshot.branchParams.size(),
+                                                   [&](size_t i) -> const BranchParameters& { return snapshot.branchParams[i]; }, snapshot.connections,
+                                                   snapshot.multiplicity.empty() ? nullptr : snapshot.multiplicity.data());
+                lock.lock();
+                if (success) written++;
+                pending = false;
+                done.notify_all();
+            }
+            else if (stopping) return;
+        }
+    };
+};
@@ -0,0 +1,384 @@
+//
+//  connectivity.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 16.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// The orders in which the branches can be stored, see BranchConnectivity::layout()
+enum class BranchLayout {
+    DepthFirst,     // every subtree is one contiguous block
+    BreadthFirst,   // layer by layer
+    VanEmdeBoas     // recursively split into a top tree and bottom trees of half the height
+};
+
+// This holds one list of branch indices per branch in a single array (like a
+// CSR matrix). Every list has some capacity, a list that runs out of capacity
+// is moved to the end of the array with twice the capacity, so appending to a
+// list is amortized O(1). The holes left behind are removed by compact().
+class IndexLists {
+public:
+    size_t size() const { return begin.size(); };
+    uint32_t count(int32_t list) const { return counts[list]; };
+    const int32_t* data(int32_t list) const { return entries.data() + begin[list]; };
+
+    void reserve(size_t lists, size_t totalEntries) {
+        begin.reserve(lists); counts.reserve(lists); capacity.reserve(lists);
+        entries.reserve(totalEntries);
+    };
+
+    void addList() {
+        begin.push_back((uint32_t)entries.size());
+        counts.push_back(0);
+        capacity.push_back(0);
+    };
+
+    // Appends -count- lists at once, list k holds the values
+    // [first[k], first[k + 1]) plus -offset-
+    void appendLists(size_t count, const uint64_t* first, const int32_t* values, int32_t offset) {
+        uint32_t base = (uint32_t)entries.size();
+        entries.resize(base + (first[count] - first[0]));
+        for (size_t k = 0; k < count; k++) {
+            begin.push_back(base + uint32_t(first[k] - first[0]));
+            counts.push_back(uint32_t(first[k + 1] - first[k]));
+            capacity.push_back(counts.back());
+        }
+        int32_t* target = entries.data() + base;
+        for (uint64_t c = first[0]; c < first[count]; c++) *target++ = values[c] + offset;
+    };
+
+    // Appends -count- empty lists that can hold -capacities[k]- values each
+    void addLists(size_t count, const uint32_t* capacities) {
+        for (size_t k = 0; k < count; k++) {
+            begin.push_back((uint32_t)entries.size());
+            counts.push_back(0);
+            capacity.push_back(capacities[k]);
+            entries.resize(entries.size() + capacities[k]);
+        }
+    };
+
+    void push(int32_t list, int32_t value) {
+        if (counts[list] == capacity[list]) grow(list);
+        entries[begin[list] + counts[list]++] = value;
+    };
+
+    // Removes the first occurence of -value- from the list, keeps the order
+    bool erase(int32_t list, int32_t value) {
+        int32_t* first = entries.data() + begin[list];
+        for (uint32_t i = 0; i < counts[list]; i++) {
+            if (first[i] != value) continue;
+            for (uint32_t j = i + 1; j < counts[list]; j++) first[j - 1] = first[j];
+            counts[list]--;
+            return true;
+        }
+        return false;
+    };
+
+    void clear(int32_t list) { counts[list] = 0; };
+
+    // Rebuilds the lists without holes. -remap- maps every old list (and
+    // entry) to its new index or to a negative value if it was removed. The
+    // lists are stored in the order of their new indices.
+    void compact(const std::vector<int32_t>& remap, size_t newSize) {
+        std::vector<uint32_t> newBegin(newSize), newCounts(newSize);
+        std::vector<int32_t> newEntries;
+        newEntries.reserve(entries.size() - garbage);
+
+        std::vector<int32_t> oldIndex(newSize);
+        for (size_t i = 0; i < size(); i++) if (remap[i] >= 0) oldIndex[remap[i]] = int32_t(i);
+        for (size_t n = 0; n < newSize; n++) {
+            int32_t i = oldIndex[n];
+            newBegin[n] = (uint32_t)newEntries.size();
+            for (uint32_t j = 0; j < counts[i]; j++) {
+                int32_t target = entries[begin[i] + j];
+                if (remap[target] >= 0) newEntries.push_back(remap[target]);
+            }
+            newCounts[n] = (uint32_t)newEntries.size() - newBegin[n];
+        }
+
+        begin.swap(newBegin);
+        counts.swap(newCounts);
+        capacity = counts;
+        entries.swap(newEntries);
+        garbage = 0;
+    };
+
+private:
+    std::vector<uint32_t> begin;
+    std::vector<uint32_t> counts;
+    std::vector<uint32_t> capacity;
+    std::vector<int32_t> entries;
+    size_t garbage = 0;
+
+    void grow(int32_t list) {
+        uint32_t newCapacity = capacity[list] ? 2 * capacity[list] : 2;
+        if (begin[list] + capacity[list] == entries.size()) {
+            // The list is at the end of the array, it can simply grow
+            entries.resize(begin[list] + newCapacity);
+        }
+        else {
+            uint32_t newBegin = (uint32_t)entries.size();
+            entries.resize(newBegin + newCapacity);
+            for (uint32_t i = 0; i < counts[list]; i++) entries[newBegin + i] = entries[begin[list] + i];
+            begin[list] = newBegin;
+            garbage += capacity[list];
+        }
+        capacity[list] = newCapacity;
+    };
+};
+
+// This is the index based connectivity of the lung branches. Every branch has
+// a list of connections and a list of the branches that connect to it (its
+// children). The first connection of a branch is its parent, which is stored
+// separately for O(1) lookup during the branch updates.
+//
+// Removed branches are only marked as removed (tombstoned), the lung compacts
+// its branches and the connectivity before it uses them again.
+class BranchConnectivity {
+public:
+    static constexpr int32_t none = -1;
+
+    size_t size() const { return parents.size(); };
+    size_t tombstoneCount() const { return tombstones; };
+    bool isAlive(int32_t branch) const { return alive[branch]; };
+
+    inline int32_t parent(int32_t branch) const { return parents[branch]; };
+    const IndexLists& connections() const { return connectionLists; };
+    const IndexLists& children() const { return childLists; };
+
+    void reserve(size_t branches) {
+        parents.reserve(branches);
+        alive.reserve(branches);
+        connectionLists.reserve(branches, branches);
+        childLists.reserve(branches, 2 * branches);
+    };
+
+    int32_t addBranch() {
+        parents.push_back(none);
+        alive.push_back(1);
+        connectionLists.addList();
+        childLists.addList();
+        return int32_t(parents.size() - 1);
+    };
+
+    // Adds -count- branches at once, the connections of new branch k are
+    // -targets-[first[k], first[k + 1]), counted from the first new branch.
+    // All lists are created with the right size, so nothing has to grow.
+    void addBranches(size_t count, const uint64_t* first, const int32_t* targets) {
+        int32_t base = (int32_t)size();
+        std::vector<uint32_t> childCounts(count, 0);
+        for (uint64_t c = first[0]; c < first[count]; c++) childCounts[targets[c]]++;
+
+        connectionLists.appendLists(count, first, targets, base);
+        childLists.addLists(count, childCounts.data());
+        parents.resize(base + count, none);
+        alive.resize(base + count, 1);
+        for (size_t k = 0; k < count; k++) {
+            int32_t branch = base + int32_t(k);
+            for (uint64_t c = first[k]; c < first[k + 1]; c++) childLists.push(base + targets[c], branch);
+            updateParent(branch);
+        }
+    };
+
+    void addConnection(int32_t branch, int32_t target) {
+        connectionLists.push(branch, target);
+        childLists.push(target, branch);
+        if (parents[branch] == none) parents[branch] = target;
+    };
+
+    void deleteConnection(int32_t branch, int32_t target) {
+        if (!connectionLists.erase(branch, target)) return;
+        childLists.erase(target, branch);
+        updateParent(branch);
+    };
+
+    void deleteConnections(int32_t branch) {
+        const int32_t* targets = connectionLists.data(branch);
+        for (uint32_t i = 0; i < connectionLists.count(branch); i++) childLists.erase(targets[i], branch);
+        connectionLists.clear(branch);
+        parents[branch] = none;
+    };
+
+    // This removes all connections from and to the branch and marks it as
+    // removed, the index stays valid until compact() is called.
+    void removeBranch(int32_t branch) {
+        if (!alive[branch]) return;
+        const int32_t* children = childLists.data(branch);
+        for (uint32_t i = 0; i < childLists.count(branch); i++) {
+            connectionLists.erase(children[i], branch);
+            updateParent(children[i]);
+        }
+        childLists.clear(branch);
+        deleteConnections(branch);
+
+        alive[branch] = 0;
+        tombstones++;
+    };
+
+    // Drops the removed branches and renumbers the others in their current
+    // order. Returns the map from the old to the new indices (none if removed).
+    std::vector<int32_t> compact() {
+        std::vector<int32_t> remap(size());
+        int32_t next = 0;
+        for (size_t i = 0; i < size(); i++) remap[i] = alive[i] ? next++ : none;
+
+        connectionLists.compact(remap, next);
+        childLists.compact(remap, next);
+
+        parents.resize(next);
+        alive.assign(next, 1);
+        for (int32_t i = 0; i < next; i++) updateParent(i);
+        tombstones = 0;
+        return remap;
+    };
+
+    // Renumbers the branches, -remap- maps every old index to its new index.
+    // There must not be any removed branches.
+    void permute(const std::vector<int32_t>& remap) {
+        connectionLists.compact(remap, size());
+        childLists.compact(remap, size());
+        for (size_t i = 0; i < size(); i++) updateParent(int32_t(i));
+    };
+
+    // The new index of every branch for the given layout of the tree that is
+    // spanned by the parents. A parent always comes before its children and
+    // the children keep their order. Needs a compacted connectivity.
+    std::vector<int32_t> layout(BranchLayout order) const {
+        std::vector<int32_t> sequence;
+        sequence.reserve(size());
+        std::vector<int32_t> roots;
+        for (size_t i = 0; i < size(); i++) if (parents[i] == none) roots.push_back(int32_t(i));
+
+        if (order == BranchLayout::BreadthFirst) {
+            sequence = roots;
+            for (size_t k = 0; k < sequence.size(); k++) appendTreeChildren(sequence[k], sequence);
+        }
+        else if (order == BranchLayout::DepthFirst) {
+            for (int32_t root : roots) appendDepthFirst(root, -1, sequence);
+        }
+        else {
+            std::vector<int32_t> heights = treeHeights();
+            for (int32_t root : roots) appendVanEmdeBoas(root, heights[root], sequence);
+        }
+
+        // Branches in cycles without a root are kept at the end
+        std::vector<int32_t> remap(size(), none);
+        int32_t next = 0;
+        for (int32_t branch : sequence) remap[branch] = next++;
+        for (size_t i = 0; i < size(); i++) if (remap[i] == none) remap[i] = next++;
+        return remap;
+    };
+
+private:
+    std::vector<int32_t> parents;
+    std::vector<uint8_t> alive;
+    IndexLists connectionLists;
+    IndexLists childLists;
+    size_t tombstones = 0;
+
+    inline void updateParent(int32_t branch) {
+        parents[branch] = connectionLists.count(branch) ? connectionLists.data(branch)[0] : none;
+    };
+
+    // The children of a branch in the tree spanned by the parents, the child
+    // lists also hold the branches that connect to it but have another parent
+    inline void appendTreeChildren(int32_t branch, std::vector<int32_t>& sequence) const {
+        const int32_t* children = childLists.data(branch);
+        for (uint32_t j = 0; j < childLists.count(branch); j++)
+            if (parents[children[j]] == branch) sequence.push_back(children[j]);
+    };
+
+    // Appends the subtree of -branch- in preorder, only down to -depth- levels
+    // if -depth- is not negative
+    void appendDepthFirst(int32_t branch, int depth, std::vector<int32_t>& sequence) const {
+        std::vector<std::pair<int32_t, int>> stack{{branch, depth}};
+        std::vector<int32_t> children;
+        while (!stack.empty()) {
+            auto [next, remaining] = stack.back();
+            stack.pop_back();
+            sequence.push_back(next);
+            if (remaining == 1) continue;
+            children.clear();
+            appendTreeChildren(next, children);
+            for (auto child = children.rbegin(); child != children.rend(); child++) stack.push_back({*child, remaining - 1});
+        }
+    };
+
+    // The number of levels of the subtree of every branch
+    std::vector<int32_t> treeHeights() const {
+        std::vector<int32_t> sequence;
+        for (size_t i = 0; i < size(); i++) if (parents[i] == none) sequence.push_back(int32_t(i));
+        for (size_t k = 0; k < sequence.size(); k++) appendTreeChildren(sequence[k], sequence);
+
+        std::vector<int32_t> heights(size(), 1);
+        for (size_t k = sequence.size(); k-- > 0;) {
+            int32_t branch = sequence[k];
+            if (parents[branch] != none) heights[parents[branch]] = std::max(heights[parents[branch]], heights[branch] + 1);
+        }
+        return heights;
+    };
+
+    // The top half of the levels is laid out first, then every subtree that
+    // hangs below it, both recursively in the same way
+    void appendVanEmdeBoas(int32_t branch, int height, std::vector<int32_t>& sequence) const {
+        if (height <= 2) {
+            appendDepthFirst(branch, height, sequence);
+            return;
+        }
+        int top = height / 2;
+        appendVanEmdeBoas(branch, top, sequence);
+
+        // The roots of the bottom trees are the branches -top- levels below
+        std::vector<int32_t> level{branch}, next;
+        for (int l = 0; l < top; l++) {
+            next.clear();
+            for (int32_t b : level) appendTreeChildren(b, next);
+            level.swap(next);
+        }
+        for (int32_t root : level) appendVanEmdeBoas(root, height - top, sequence);
+    };
+};
+
+// This is what the branches need to find their connections: the connectivity
+// and the current location of the branches in memory, which the lung keeps up
+// to date whenever the branch vector reallocates.
+template <class Branch>
+struct BranchTopology {
+    Branch* branches = nullptr;
+    BranchConnectivity connectivity;
+};
+
+// A view on the connections of a branch, it behaves like a vector of pointers
+// to the connected branches, but does not copy anything.
+template <class Branch>
+class ConnectionList {
+public:
+    struct iterator {
+        Branch* base;
+        const int32_t* index;
+        Branch* operator*() const { return base + *index; };
+        iterator& operator++() { index++; return *this; };
+        bool operator!=(const iterator& other) const { return index != other.index; };
+    };
+
+    ConnectionList() {};
+    ConnectionList(Branch* base, const int32_t* first, uint32_t count) : base(base), first(first), count(count) {};
+
+    size_t size() const { return count; };
+    Branch* operator[](size_t i) const { return base + first[i]; };
+    int32_t index(size_t i) const { return first[i]; };
+    iterator begin() const { return {base, first}; };
+    iterator end() const { return {base, first + count}; };
+
+private:
+    Branch* base = nullptr;
+    const int32_t* first = nullptr;
+    uint32_t count = 0;
+};
@@ -0,0 +1,116 @@
+//
+//  deltaHistory.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 16.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "model_params.h"
+
+// This is a detailed history that does not copy every branch at every record.
+// Every -keyframeInterval- records a full copy of all branch parameters is
+// stored (a keyframe), in between only the BranchState of the branches that
+// changed since the previous record is stored (a delta). The state at any
+// record is the preceding keyframe with the deltas up to the record applied.
+class DeltaHistory {
+public:
+    void reset(int keyframeInterval = 1000) {
+        this->keyframeInterval = keyframeInterval > 0 ? keyframeInterval : 1;
+        keyframes.clear();
+        keyframeRecords.clear();
+        deltaOffsets.assign(1, 0);
+        deltaIndices.clear();
+        deltaStates.clear();
+        last.clear();
+        steps.clear();
+    };
+
+    size_t size() const { return deltaOffsets.size() - 1; };
+
+    // Makes the next record a keyframe, e.g. when the branches were reordered
+    void invalidate() { last.clear(); };
+
+    // Memory used by the keyframes and deltas in bytes
+    size_t getBytes() const {
+        size_t bytes = deltaIndices.size() * sizeof(int32_t) + deltaStates.size() * sizeof(BranchState) + deltaOffsets.size() * sizeof(size_t) + steps.size() * sizeof(int);
+        for (auto& keyframe : keyframes) bytes += keyframe.size() * sizeof(BranchParameters);
+        return bytes;
+    };
+
+    // Adds the record of time step -step-, -branchAt(i)- has to return the
+    // parameters of branch i
+    template <class F>
+    void record(int step, size_t branchCount, F&& branchAt) {
+        size_t record = size();
+        steps.push_back(step);
+
+        // A changed number of branches also needs a new keyframe, the indices
+        // of the deltas would not fit anymore
+        if (keyframes.empty() || record - keyframeRecords.back() >= keyframeInterval || branchCount != last.size()) {
+            keyframes.emplace_back();
+            keyframes.back().reserve(branchCount);
+            last.resize(branchCount);
+            for (size_t i = 0; i < branchCount; i++) {
+                keyframes.back().push_back(branchAt(i));
+                last[i] = branchAt(i).getState();
+            }
+            keyframeRecords.push_back(record);
+            deltaOffsets.push_back(deltaIndices.size());
+            return;
+        }
+
+        for (size_t i = 0; i < branchCount; i++) {
+            BranchState state = branchAt(i).getState();
+            if (state == last[i]) continue;
+            last[i] = state;
+            deltaIndices.push_back((int32_t)i);
+            deltaStates.push_back(state);
+        }
+        deltaOffsets.push_back(deltaIndices.size());
+    };
+
+    // Writes the parameters of all branches at -record- into -branchParams-
+    void reconstruct(size_t record, std::vector<BranchParameters>& branchParams) const {
+        // The last keyframe at or before the record
+        size_t k = std::upper_bound(keyframeRecords.begin(), keyframeRecords.end(), record) - keyframeRecords.begin() - 1;
+        branchParams = keyframes[k];
+        for (size_t r = keyframeRecords[k] + 1; r <= record; r++)
+            for (size_t d = deltaOffsets[r]; d < deltaOffsets[r + 1]; d++)
+                branchParams[deltaIndices[d]].setState(deltaStates[d]);
+    };
+
+    // The last record at or before time step -step-, returns false if there is none
+    bool findRecord(int step, size_t& record) const {
+        size_t next = std::upper_bound(steps.begin(), steps.end(), step) - steps.begin();
+        if (next == 0) return false;
+        record = next - 1;
+        return true;
+    };
+
+    int getStep(size_t record) const { return steps[record]; };
+
+    // The branches that changed from the previous record to -record-
+    size_t getDeltaCount(size_t record) const { return deltaOffsets[record + 1] - deltaOffsets[record]; };
+
+private:
+    size_t keyframeInterval = 1000;
+    std::vector<std::vector<BranchParameters>> keyframes;
+    std::vector<size_t> keyframeRecords;
+
+    // The deltas of record r are at [deltaOffsets[r], deltaOffsets[r + 1])
+    std::vector<size_t> deltaOffsets = std::vector<size_t>(1, 0);
+    std::vector<int32_t> deltaIndices;
+    std::vector<BranchState> deltaStates;
+
+    // The state of the previous record
+    std::vector<BranchState> last;
+
+    // The time step of every record
+    std::vector<int> steps;
+};
@@ -0,0 +1,245 @@
+//
+//  historyWriter.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 16.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "model_params.h"
+
+// This is the layout of a history file: the header is followed by fixed size
+// records at -dataOffset-, every record holds the LungParameters and, for a
+// detailed history, the BranchParameters of all branches:
+//   [LungParameters][BranchParameters 0]...[BranchParameters branchCount - 1]
+// The schema strings list the fields of the parameter structs in the order
+// they appear in memory.
+struct HistoryFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t lungRecordSize;
+    uint32_t branchRecordSize;
+    int32_t trackingRate;
+    uint64_t branchCount;
+    uint64_t recordSize;
+    uint64_t recordCount;
+    uint64_t dataOffset;
+    double dt;
+    char lungSchema[256];
+    char branchSchema[256];
+};
+
+static constexpr char historyFileMagic[8] = {'L', 'U', 'N', 'G', 'H', 'I', 'S', 'T'};
+// Version 2 checks the branch schema, so files of the other precision (see
+// LUNG_SCALAR) are rejected
+static constexpr uint32_t historyFileVersion = 2;
+
+// This streams history records into a file. The records are collected in a
+// buffer of -chunkSize- bytes, which is written to the file whenever it is
+// full, so the memory used does not grow with the length of the run. With
+// -directIO- the page cache is bypassed (if the file system supports it).
+class HistoryWriter {
+public:
+    ~HistoryWriter() { close(); };
+
+    bool isOpen() const { return fd >= 0; };
+    size_t getRecordCount() const { return recordCount; };
+    size_t getBranchCount() const { return header.branchCount; };
+    size_t getBytesWritten() const { return header.dataOffset + recordCount * header.recordSize; };
+
+    bool open(const char* path, size_t branchCount, int trackingRate, double dt, bool directIO = false, size_t chunkSize = 4 << 20) {
+        close();
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+        if (directIO) fd = ::open(path, flags | O_DIRECT, 0644);
+#endif
+        if (fd < 0) fd = ::open(path, flags, 0644);
+        if (fd < 0) {
+            std::cout << "ERROR: Could not open the history file " << path << std::endl;
+            return false;
+        }
+#ifdef F_NOCACHE
+        if (directIO) fcntl(fd, F_NOCACHE, 1);
+#endif
+
+        this->chunkSize = (chunkSize + alignment - 1) / alignment * alignment;
+        buffer = (char*)aligned_alloc(alignment, this->chunkSize);
+        fill = 0;
+        recordCount = 0;
+        fileOffset = alignment;
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, historyFileMagic, sizeof(header.magic));
+        header.version = historyFileVersion;
+        header.lungRecordSize = sizeof(LungParameters);
+        header.branchRecordSize = sizeof(BranchParameters);
+        header.trackingRate = trackingRate;
+        header.branchCount = branchCount;
+        header.recordSize = sizeof(LungParameters) + branchCount * sizeof(BranchParameters);
+        header.dataOffset = alignment;
+        header.dt = dt;
+        strncpy(header.lungSchema, LungParameters::schema, sizeof(header.lungSchema) - 1);
+        strncpy(header.branchSchema, BranchParameters::schema, sizeof(header.branchSchema) - 1);
+        return writeHeader();
+    };
+
+    // Appends one record, -branchAt(i)- has to return the parameters of branch i
+    template <class F>
+    void write(const LungParameters& lungPrm, F&& branchAt) {
+        append(&lungPrm, sizeof(LungParameters));
+        for (size_t i = 0; i < header.branchCount; i++) append(&branchAt(i), sizeof(BranchParameters));
+        recordCount++;
+    };
+
+    // Writes everything that is left in the buffer and finalizes the header
+    void close() {
+        if (fd < 0) return;
+        size_t size = fileOffset + fill;
+        if (fill > 0) {
+            // Direct I/O can only write whole blocks, the padding is cut off again
+            size_t padded = (fill + alignment - 1) / alignment * alignment;
+            memset(buffer + fill, 0, padded - fill);
+            flush(padded);
+        }
+        if (ftruncate(fd, size) != 0) std::cout << "ERROR: Could not truncate the history file" << std::endl;
+        header.recordCount = recordCount;
+        writeHeader();
+        ::close(fd);
+        fd = -1;
+        free(buffer);
+        buffer = nullptr;
+    };
+
+private:
+    // Block size for direct I/O, the records start at this offset
+    static constexpr size_t alignment = 4096;
+
+    HistoryFileHeader header;
+    int fd = -1;
+    char* buffer = nullptr;
+    size_t chunkSize = 0;
+    size_t fill = 0;
+    size_t fileOffset = 0;
+    size_t recordCount = 0;
+
+    inline void append(const void* data, size_t bytes) {
+        const char* source = (const char*)data;
+        while (bytes > 0) {
+            size_t n = std::min(bytes, chunkSize - fill);
+            memcpy(buffer + fill, source, n);
+            fill += n;
+            source += n;
+            bytes -= n;
+            if (fill == chunkSize) flush(chunkSize);
+        }
+    };
+
+    void flush(size_t bytes) {
+        if (pwrite(fd, buffer, bytes, fileOffset) != (ssize_t)bytes)
+            std::cout << "ERROR: Could not write to the history file" << std::endl;
+        fileOffset += fill;
+        fill = 0;
+    };
+
+    bool writeHeader() {
+        char* block = (char*)aligned_alloc(alignment, alignment);
+        memset(block, 0, alignment);
+        memcpy(block, &header, sizeof(header));
+        bool success = pwrite(fd, block, alignment, 0) == (ssize_t)alignment;
+        free(block);
+        if (!success) std::cout << "ERROR: Could not write the history file header" << std::endl;
+        return success;
+    };
+};
+
+// This maps a history file into memory and gives random access to its records
+// without reading the whole file.
+class HistoryReader {
+public:
+    ~HistoryReader() { close(); };
+
+    bool open(const char* path) {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            std::cout << "ERROR: Could not open the history file " << path << std::endl;
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(HistoryFileHeader)) {
+            ::close(fd);
+            std::cout << "ERROR: " << path << " is not a history file of this model" << std::endl;
+            return false;
+        }
+        mappedSize = info.st_size;
+        mapped = (char*)mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            mapped = nullptr;
+            std::cout << "ERROR: Could not map the history file " << path << std::endl;
+            return false;
+        }
+
+        header = (const HistoryFileHeader*)mapped;
+        if (memcmp(header->magic, historyFileMagic, sizeof(header->magic)) != 0 || header->version != historyFileVersion
+            || header->lungRecordSize != sizeof(LungParameters) || header->branchRecordSize != sizeof(BranchParameters)
+            || strncmp(header->branchSchema, BranchParameters::schema, sizeof(header->branchSchema)) != 0) {
+            std::cout << "ERROR: " << path << " is not a history file of this model" << std::endl;
+            close();
+            return false;
+        }
+        // The records are read in place, so their size has to be exactly the
+        // one of the branch count (checked without overflowing) and they have
+        // to start behind the header at the alignment of the lung parameters
+        if (header->branchCount > (UINT64_MAX - sizeof(LungParameters)) / sizeof(BranchParameters)
+            || header->recordSize != sizeof(LungParameters) + header->branchCount * sizeof(BranchParameters)
+            || header->dataOffset < sizeof(HistoryFileHeader) || header->dataOffset % alignof(LungParameters) != 0) {
+            std::cout << "ERROR: The records of the history file " << path << " do not match its header" << std::endl;
+            close();
+            return false;
+        }
+
+        // A run that did not close the file still has all complete records
+        recordCount = mappedSize > header->dataOffset ? (mappedSize - header->dataOffset) / header->recordSize : 0;
+        return true;
+    };
+
+    void close() {
+        if (mapped) munmap(mapped, mappedSize);
+        mapped = nullptr;
+        header = nullptr;
+        recordCount = 0;
+    };
+
+    size_t size() const { return recordCount; };
+    size_t getBranchCount() const { return header->branchCount; };
+    int getTrackingRate() const { return header->trackingRate; };
+    double getDt() const { return header->dt; };
+
+    const LungParameters& getLungParameters(size_t record) const {
+        return *(const LungParameters*)(mapped + header->dataOffset + record * header->recordSize);
+    };
+
+    // The parameters of all branches in this record, nullptr if the history is not detailed
+    const BranchParameters* getBranchParameters(size_t record) const {
+        if (header->branchCount == 0) return nullptr;
+        return (const BranchParameters*)(mapped + header->dataOffset + record * header->recordSize + sizeof(LungParameters));
+    };
+
+private:
+    char* mapped = nullptr;
+    size_t mappedSize = 0;
+    const HistoryFileHeader* header = nullptr;
+    size_t recordCount = 0;
+};
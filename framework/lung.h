@@ -8,26 +8,72 @@
 
 #pragma once
 
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
 #include <vector>
 #include <thread>
 #include "lungBranch.h"
+#include "asyncHistory.h"
+#include "checkpoint.h"
+#include "deltaHistory.h"
+#include "historyWriter.h"
+#include "observables.h"
+#include "profiler.h"
+#include "structureFile.h"
+#include "subtreeCompression.h"
+#include "telemetry.h"
+#include "threadPool.h"
 
 // This is the general lung framework that will be the same for every lung model
 
-// TODO: removing a branch will mess with the connections, think about how to do it.
 // TODO: Think of a good way to visualize the system
 
 struct FunctionalParameters {
     bool detailedHistory = false; // This will take up much RAM if used with a big lung network
+    bool deltaHistory = false; // Detailed history that only stores the changes, see trackDeltaHistory()
     bool globalParamsEnabled = false;
     int useMultithreading = 1;
+    int threadingGrain = 1024; // Number of branches handed to a thread at once
+    bool frontierStepping = false;
     int historyTrackingRate = 0;
+    int checkpointRate = 0; // See checkpointPeriodically()
     int timeSteps = 0;
 };
 
 typedef std::pair<LungParameters, std::vector<BranchParameters>> HistoryPair;
 
-template <class Branch>
+// These are the options of a lung that are fixed at compile time, the update
+// routines do not compile the code of the options that are turned off. The
+// members behind them (the thread pool, the history buffers) are still part
+// of the lung, they just never start a thread or hold a record:
+// -history-: the history can be tracked, without it a step only counts itself
+// -threading-: the branch updates can run on the thread pool
+// -staticTopology-: no branches are removed once they are added, so the
+//  update routines do not have to check for removed branches
+template <bool history = true, bool threading = true, bool staticTopology = false>
+struct LungPolicy {
+    static constexpr bool hasHistory = history;
+    static constexpr bool hasThreading = threading;
+    static constexpr bool hasStaticTopology = staticTopology;
+};
+
+// This sums up doubles exactly as 128 bit fixed point numbers. The result does
+// not depend on the order of the summation, so every update routine and any
+// number of threads yield exactly the same sum. Values have to be smaller
+// than 2^46, values smaller than 2^-80 are lost.
+struct ExactSum {
+    __int128 value = 0;
+
+    inline void add(double x) { if (x != 0) value += (__int128)(x * 0x1p80); };
+    // The same as adding -x- -times- times
+    inline void add(double x, uint64_t times) { if (x != 0) value += (__int128)(x * 0x1p80) * (__int128)times; };
+    inline void add(const ExactSum& other) { value += other.value; };
+    inline double get() const { return (double)value * 0x1p-80; };
+};
+
+template <class Branch, class Policy = LungPolicy<>>
 class Lung {
 protected:
     // This is where all the member variables are located. It is wise to protect
@@ -40,80 +86,671 @@ protected:
     std::vector<Branch> branches;
     std::vector<HistoryPair> history;
 
-    // virtual protected member functions
-    virtual void init() {
-        // This will allocate enough memory for all branches. If this is set to
-        // the wrong size the vector will reallocate in memory and all the
-        // connections become invalid! So it is better to reserve more space
-        // than needed!
+    // If a history file is given the history is streamed into it instead of
+    // being kept in the history vector, see streamHistory()
+    std::string historyPath;
+    bool historyDirectIO = false;
+    HistoryWriter historyWriter;
+
+    // The branch part of the detailed history when it is delta encoded
+    DeltaHistory deltaHistory;
+
+    // Hands the history events to a background thread, see captureHistoryAsync().
+    // This has to stay behind the history members, the background thread uses
+    // them until it is stopped.
+    AsyncHistory asyncHistory;
+
+    // The number of history events so far, see getHistoryCursor()
+    size_t historyCursor = 0;
+
+    // See checkpointPeriodically(), the background thread only works on its
+    // own copy of the state
+    std::string checkpointPath;
+    bool asyncCheckpoints = true;
+    CheckpointWriter checkpointWriter;
+
+    // The connections of the branches by index, see connectivity.h
+    BranchTopology<Branch> topology;
+
+    // The number of branches of the full tree every branch stands for, this
+    // is empty unless the lung is compressed, see addCompressedBranches()
+    std::vector<uint64_t> multiplicity;
+
+    // The worker threads live as long as the lung, see useThreading()
+    ThreadPool threadPool;
+    // One partial sum per thread for the reductions, see parallelSum()
+    struct alignas(64) ThreadSum { ExactSum sum; };
+    std::vector<ThreadSum> threadSums = std::vector<ThreadSum>(1);
+
+    // Only measures something with -DLUNG_PROFILING, see profiler.h
+    LungProfiler profiler;
+
+    // See addObservable(), they are reset whenever the branches or the number
+    // of threads changed
+    LungObservables observables;
+    unsigned long observablesVersion = -1;
+    size_t observablesThreads = 0;
+
+    // See publishTelemetry(), the segment is created with the first record,
+    // when the columns of the observables are known
+    TelemetryPublisher telemetry;
+    std::string telemetryName;
+    std::vector<std::string> telemetryColumns;
+    std::vector<int> telemetryColumnIndex;
+    std::vector<double> telemetrySample, telemetryValues;
+    int telemetryRate = 0;
+    int telemetrySlots = 0;
+
+    // This is increased whenever branches are added or removed, everything that
+    // is derived from the tree structure has to be rebuilt once it changed
+    unsigned long topologyVersion = 0;
+
+    // Branch indices sorted by descending layer_ID and the start of every layer
+    // in that list, see levelSynchronousUpdateBranches()
+    std::vector<int> levelOrder;
+    std::vector<size_t> levelOffsets;
+    unsigned long levelScheduleVersion = -1;
+    bool levelScheduleValid = false;
+
+    // The branches that can still change (see LungBranch::isActive()) and a flag
+    // for every branch if it is part of the frontier
+    std::vector<int> frontier;
+    std::vector<uint8_t> inFrontier;
+    unsigned long frontierVersion = -1;
+
+    // protected member functions, the models call these from their own
+    // versions, there is no virtual call involved
+    void init() {
+        // This will allocate enough memory for all branches. The connections
+        // are stored by index and survive a reallocation, but the pointers
+        // returned by addBranch() do not, so if they are kept around it is
+        // better to reserve the right size.
         branches.reserve(externPrm.N_branches);
+        topology.connectivity.reserve(externPrm.N_branches);
     };
 
-    virtual inline void updateBranches(TimeStepParameters* q) {
+    // All the update routines return the sum of the return values of the branch
+    // time steps, i.e. the change of the lung volume, so the lung does not have
+    // to sum up all the branch volumes again after the update.
+    inline double updateBranches(TimeStepParameters* q) {
+        compactBranches();
+        prepareObservables();
+        LUNG_PROFILE_VISITED(profiler, branches.size());
+        ExactSum volumeChange;
         for (int i = (int)branches.size() - 1; i >= 0; i--)
-            branches[i].timeStep(&externPrm, &lungPrm, q);
+            updateBranch(volumeChange, i, q);
+        return volumeChange.get();
     }
 
-    // TODO: There is an error with the order of operations in mt which can cause
-    // the simulation to behave strangely
-    virtual inline void asyncUpdateBranches(TimeStepParameters* q) {
-        // This calls all the threads for updating the branches, if multithreading
-        // is off: only one thread will be created and this function should not be used.
-        if (functionalPrm.useMultithreading <= 0) {
-          std::cout << "Threading not enabled! Setting up threading with 4 threads..." << std::endl;
-          functionalPrm.useMultithreading = 4;
+    // The volume change -dV- of branch i counts once for every branch it
+    // stands for, see addCompressedBranches(). The branch has just been
+    // updated by the thread -thread-, the observables see it if its volume or
+    // its open state (-opened-) changed.
+    inline void addVolumeChange(ExactSum& volumeChange, int i, double dV, int thread = 0, bool opened = false) {
+        if (multiplicity.empty()) volumeChange.add(dV);
+        else volumeChange.add(dV, multiplicity[i]);
+        if ((dV != 0 || opened) && observables.isActive())
+            observables.observe(thread, i, dV, branches[i]._getBranchParameters()->getState(), getMultiplicity(i));
+    };
+
+    // Runs the time step of branch i and adds its volume change. A branch can
+    // open without changing its volume (e.g. if it is at V_max already), so
+    // the observables compare the open state as well. The profiler counts
+    // the opened branches of this lung the same way.
+    inline void updateBranch(ExactSum& volumeChange, int i, TimeStepParameters* q, int thread = 0, ExternalParameters* _extern_params = nullptr) {
+        if (!_extern_params) _extern_params = &externPrm;
+        if (!observables.isActive() && !LungProfiler::enabled) {
+            addVolumeChange(volumeChange, i, branches[i].timeStep(_extern_params, &lungPrm, q), thread);
+            return;
         }
-        std::vector<std::thread> threads(functionalPrm.useMultithreading);
-        for (int i = 0; i < functionalPrm.useMultithreading; i++)
-        {
-            // Currently the threads take care of the Nth part of the branch count.
-            // This might not be the best partitioning for asymetrical branch updates.
-            // TODO: Should this be adjustable?
-            threads[i] = std::thread(&Lung::partialTimeStep, this, int(i * double(branches.size())/double(functionalPrm.useMultithreading)), int((i + 1) * double(branches.size())/double(functionalPrm.useMultithreading)) , q);
+        bool wasOpen = branches[i]._getBranchParameters()->isOpen;
+        double dV = branches[i].timeStep(_extern_params, &lungPrm, q);
+        bool opened = branches[i]._getBranchParameters()->isOpen != wasOpen;
+        LUNG_PROFILE_OPENED(profiler, thread, opened);
+        addVolumeChange(volumeChange, i, dV, thread, opened);
+    };
+
+    // Has to be called before the branch update, after the branches are compacted
+    inline void prepareObservables() {
+        if (!observables.isActive() || (observablesVersion == topologyVersion && observablesThreads == threadSums.size())) return;
+        synchronizeBranches();
+        observablesVersion = topologyVersion;
+        observablesThreads = threadSums.size();
+        observables.reset({branches.size(), [&](size_t i) -> const BranchParameters& { return *branches[i]._getBranchParameters(); },
+                           [&](size_t i) { return getMultiplicity(int(i)); }}, int(observablesThreads));
+    };
+
+    // Has to be called at the end of every step, after the step is counted
+    inline void endObservedStep() {
+        if (observables.isActive()) {
+            prepareObservables();
+            observables.endStep(functionalPrm.timeSteps);
         }
-        // Join the threads before leaving this function, otherwise nothing is
-        // guaranteed to work as intended.
-        for (int i = 0; i < functionalPrm.useMultithreading; i++) {
-          threads[i].join();
+        if (telemetryRate > 0 && functionalPrm.timeSteps % telemetryRate == 0) publishTelemetryRecord();
+    };
+
+    void publishTelemetryRecord() {
+        LUNG_PROFILE_PHASE(profiler, ProfilePhase::History);
+        if (!telemetry.isOpen() && !openTelemetry()) { telemetryRate = 0; return; }
+        telemetrySample.clear();
+        observables.sample(telemetrySample);
+        for (size_t c = 0; c < telemetryColumnIndex.size(); c++) telemetryValues[c] = telemetrySample[telemetryColumnIndex[c]];
+        telemetry.publish(functionalPrm.timeSteps, lungPrm, telemetryValues.data());
+    };
+
+    bool openTelemetry() {
+        prepareObservables();
+        const std::vector<std::string>& available = observables.getColumns();
+        std::vector<std::string> names;
+        telemetryColumnIndex.clear();
+        for (size_t c = 0; c < available.size(); c++) {
+            if (!telemetryColumns.empty() && std::find(telemetryColumns.begin(), telemetryColumns.end(), available[c]) == telemetryColumns.end()) continue;
+            names.push_back(available[c]);
+            telemetryColumnIndex.push_back(int(c));
+        }
+        if (names.size() < telemetryColumns.size())
+            std::cout << "WARNING: Not all telemetry columns are observed, see addObservable()" << std::endl;
+        telemetryValues.resize(names.size());
+        return telemetry.open(telemetryName, names, telemetrySlots, telemetryRate, externPrm.dt);
+    };
+
+    // This calls f(i, sum, thread) for every i in [0, N) on the thread pool, f
+    // adds to the partial sum -sum- of its thread. Returns the total.
+    template <class F>
+    inline ExactSum parallelSum(size_t N, F&& f) {
+        for (auto& partial : threadSums) partial.sum = ExactSum();
+        LUNG_PROFILE_PARALLEL_BEGIN(profiler, threadPool.size());
+        threadPool.parallelFor(N, functionalPrm.threadingGrain, [&](size_t N_min, size_t N_max, int thread) {
+            LUNG_PROFILE_CHUNK(profiler, thread);
+            ExactSum sum;
+            for (size_t i = N_min; i < N_max; i++) f(i, sum, thread);
+            threadSums[thread].sum.add(sum);
+        });
+        LUNG_PROFILE_PARALLEL_END(profiler);
+        ExactSum sum;
+        for (auto& partial : threadSums) sum.add(partial.sum);
+        return sum;
+    };
+
+    // The order of operations in here differs from updateBranches(), so a branch
+    // that reads the state of its connections can see them before or after
+    // their update. Use levelSynchronousUpdateBranches() for those models.
+    inline double asyncUpdateBranches(TimeStepParameters* q) {
+        if constexpr (!Policy::hasThreading) return updateBranches(q);
+        else {
+            // This hands the branches to the worker threads of the pool, if multithreading
+            // is off: only the calling thread would work and this function should not be used.
+            if (functionalPrm.useMultithreading <= 0) {
+              std::cout << "Threading not enabled! Setting up threading with 4 threads..." << std::endl;
+              useThreading(4);
+            }
+            // The branches are processed in chunks of -threadingGrain- branches and
+            // idle threads steal chunks from busy ones, so asymetrical branch updates
+            // are balanced out. The pool returns once all chunks are done.
+            compactBranches();
+            prepareObservables();
+            LUNG_PROFILE_VISITED(profiler, branches.size());
+            for (auto& partial : threadSums) partial.sum = ExactSum();
+            LUNG_PROFILE_PARALLEL_BEGIN(profiler, threadPool.size());
+            threadPool.parallelFor(branches.size(), functionalPrm.threadingGrain, [&](size_t N_min, size_t N_max, int thread) {
+                LUNG_PROFILE_CHUNK(profiler, thread);
+                threadSums[thread].sum.add(partialTimeStep(int(N_min), int(N_max), q, thread));
+            });
+            LUNG_PROFILE_PARALLEL_END(profiler);
+            ExactSum volumeChange;
+            for (auto& partial : threadSums) volumeChange.add(partial.sum);
+            return volumeChange.get();
+        }
+    };
+
+    inline ExactSum partialTimeStep(int N_min, int N_max, TimeStepParameters* q, int thread = 0) {
+        ExactSum volumeChange;
+        for (int i = N_min; i < N_max; i++) updateBranch(volumeChange, i, q, thread);
+        return volumeChange;
+    };
+
+    // This is the deterministic threaded update: the branches are updated layer
+    // by layer, starting from the deepest layer, and in parallel within a layer.
+    // A branch thus always sees its connections in the state of the previous
+    // step, exactly like in the reverse serial loop of updateBranches(), and the
+    // results do not depend on the number of threads.
+    // This needs the layer_ID of every connection to be smaller than that of the
+    // branch and connections to be added before the branch, otherwise this falls
+    // back to updateBranches().
+    inline double levelSynchronousUpdateBranches(TimeStepParameters* q) {
+        if constexpr (!Policy::hasThreading) return updateBranches(q);
+        else {
+            compactBranches();
+            prepareObservables();
+            if (levelScheduleVersion != topologyVersion) buildLevelSchedule();
+            if (!levelScheduleValid || functionalPrm.useMultithreading <= 1)
+                return updateBranches(q);
+            LUNG_PROFILE_VISITED(profiler, branches.size());
+
+            ExactSum volumeChange;
+            for (size_t l = 0; l + 1 < levelOffsets.size(); l++) {
+                const int* level = levelOrder.data() + levelOffsets[l];
+                volumeChange.add(parallelSum(levelOffsets[l + 1] - levelOffsets[l], [&](size_t i, ExactSum& sum, int thread) {
+                    updateBranch(sum, level[i], q, thread);
+                }));
+            }
+            return volumeChange.get();
+        }
+    };
+
+    // This only updates the branches on the frontier, i.e. the branches that can
+    // still change, so the cost of a step scales with the size of the frontier
+    // instead of the number of branches. Branches that leave the frontier hand
+    // it over to the branches connected to them, which join the frontier in the
+    // next step, just like they would see the change in the serial update.
+    // This needs the branch model to implement isActive().
+    inline double frontierUpdateBranches(TimeStepParameters* q) {
+        compactBranches();
+        prepareObservables();
+        if (frontierVersion != topologyVersion) buildFrontier();
+        LUNG_PROFILE_VISITED(profiler, frontier.size());
+
+        // The branches on the frontier only read branches that are not on the
+        // frontier, so they can be updated in any order
+        ExactSum volumeChange;
+        bool threaded = false;
+        if constexpr (Policy::hasThreading) {
+            threaded = functionalPrm.useMultithreading > 1;
+            if (threaded)
+                volumeChange.add(parallelSum(frontier.size(), [&](size_t i, ExactSum& sum, int thread) {
+                    updateBranch(sum, frontier[i], q, thread);
+                }));
+        }
+        if (!threaded)
+            for (int i = (int)frontier.size() - 1; i >= 0; i--) updateBranch(volumeChange, frontier[i], q);
+
+        updateFrontier();
+        return volumeChange.get();
+    };
+
+    void buildFrontier() {
+        frontierVersion = topologyVersion;
+        frontier.clear();
+        inFrontier.assign(branches.size(), 0);
+        for (size_t i = 0; i < branches.size(); i++) {
+            if (!branches[i].isActive()) continue;
+            frontier.push_back(int(i));
+            inFrontier[i] = 1;
+        }
+    };
+
+    void updateFrontier() {
+        const IndexLists& children = topology.connectivity.children();
+        size_t size = frontier.size();
+        size_t kept = 0;
+        for (size_t k = 0; k < size; k++) {
+            int i = frontier[k];
+            if (branches[i].isActive()) { frontier[kept++] = i; continue; }
+
+            // The branch left the frontier, the branches connected to it might join
+            inFrontier[i] = 0;
+            for (uint32_t j = 0; j < children.count(i); j++) {
+                int child = children.data(i)[j];
+                if (inFrontier[child] || !branches[child].isActive()) continue;
+                frontier.push_back(child);
+                inFrontier[child] = 1;
+            }
         }
+        // Move the new branches behind the ones that stayed
+        frontier.erase(frontier.begin() + kept, frontier.begin() + size);
     };
 
-    inline void partialTimeStep(int N_min, int N_max, TimeStepParameters* q) {
-        for (int i = N_min; i < N_max; i++) branches[i].timeStep(&externPrm, &lungPrm, q);
+    void buildLevelSchedule() {
+        levelScheduleVersion = topologyVersion;
+        levelScheduleValid = true;
+        levelOrder.clear();
+        levelOffsets.clear();
+        if (branches.empty()) return;
+
+        int minLayer = branches[0]._getBranchParameters()->layer_ID;
+        int maxLayer = minLayer;
+        for (size_t i = 0; i < branches.size(); i++) {
+            int layer = branches[i]._getBranchParameters()->layer_ID;
+            minLayer = std::min(minLayer, layer);
+            maxLayer = std::max(maxLayer, layer);
+
+            const IndexLists& connections = topology.connectivity.connections();
+            for (uint32_t j = 0; j < connections.count(i); j++) {
+                int connection = connections.data(i)[j];
+                if (connection >= int(i) || branches[connection]._getBranchParameters()->layer_ID >= layer) {
+                    std::cout << "WARNING: Branch " << i << " does not fit into a layer by layer update, using the serial update instead." << std::endl;
+                    levelScheduleValid = false;
+                    return;
+                }
+            }
+        }
+
+        // Counting sort by descending layer, inside of a layer the branches keep
+        // the descending order of the serial update
+        std::vector<size_t> count(maxLayer - minLayer + 2, 0);
+        for (size_t i = 0; i < branches.size(); i++) count[maxLayer - branches[i]._getBranchParameters()->layer_ID + 1]++;
+        for (size_t l = 1; l < count.size(); l++) count[l] += count[l - 1];
+        levelOffsets = count;
+
+        levelOrder.resize(branches.size());
+        for (int i = (int)branches.size() - 1; i >= 0; i--)
+            levelOrder[count[maxLayer - branches[i]._getBranchParameters()->layer_ID]++] = i;
     };
 
+    // Models that keep the state of their branches somewhere else, e.g. in a
+    // structure of arrays, have to write it back into the branches in here.
+    // This is called before the framework reads or changes the branches.
+    virtual void synchronizeBranches() {};
+
     inline void triggerHistoryEvent() {
         // Record the changes made in this time step and write it into the history vector
         // This will only trigger every -historyTrackingRate- steps to be easier on the memory
         // If -historyTrackingRate- = 0 the history will not be created at all (default)
         functionalPrm.timeSteps++;
-        if (functionalPrm.timeSteps % functionalPrm.historyTrackingRate != 0) return;
+        LUNG_PROFILE_STEP(profiler);
+        endObservedStep();
+        if constexpr (Policy::hasHistory)
+            if (functionalPrm.historyTrackingRate > 0 && functionalPrm.timeSteps % functionalPrm.historyTrackingRate == 0) recordHistoryEvent();
+        // The checkpoint comes after the history event of the same step, so
+        // the history continues right after it when the lung is restored
+        if (functionalPrm.checkpointRate > 0 && functionalPrm.timeSteps % functionalPrm.checkpointRate == 0) writePeriodicCheckpoint();
+    }
+
+    // This creates the history entry of the current step, no matter the -historyTrackingRate-
+    void recordHistoryEvent() {
+        LUNG_PROFILE_PHASE(profiler, ProfilePhase::History);
+        historyCursor++;
+        bool withBranches = functionalPrm.detailedHistory || functionalPrm.deltaHistory;
+        if (withBranches) { synchronizeBranches(); compactBranches(); }
+        size_t branchCount = withBranches ? branches.size() : 0;
+
+        if (asyncHistory.isRunning()) {
+            // Only copy into a preallocated slot here, everything else happens
+            // on the background thread
+            HistorySnapshot* snapshot = asyncHistory.acquire(branchCount);
+            if (!snapshot) return;
+            snapshot->timeStep = functionalPrm.timeSteps;
+            snapshot->lungPrm = lungPrm;
+            for (size_t i = 0; i < branchCount; i++) snapshot->branchParams[i] = *branches[i]._getBranchParameters();
+            asyncHistory.publish();
+            return;
+        }
+
+        storeHistoryRecord(functionalPrm.timeSteps, lungPrm, branchCount, [&](size_t i) -> const BranchParameters& { return *branches[i]._getBranchParameters(); });
+    }
+
+    // This stores a history record in the delta history, the history file or
+    // the history vector. -branchAt(i)- has to return the parameters of branch i.
+    template <class F>
+    void storeHistoryRecord(int step, const LungParameters& lung, size_t branchCount, F&& branchAt) {
+        if (functionalPrm.deltaHistory) deltaHistory.record(step, branchCount, branchAt);
+
+        if (!historyPath.empty()) {
+            writeHistoryRecord(lung, branchCount, branchAt);
+            return;
+        }
 
         std::vector<BranchParameters> branchParams;
-        if (functionalPrm.detailedHistory) branchParams.reserve(branches.size());
+        if (functionalPrm.detailedHistory) branchParams.reserve(branchCount);
 
         // This will create a deep copy of the branch parameters
         if (functionalPrm.detailedHistory)
-            for (int i = 0; i < branches.size(); i++) branchParams.push_back(*branches[i]._getBranchParameters());
+            for (size_t i = 0; i < branchCount; i++) branchParams.push_back(branchAt(i));
 
         // This emplaces copies of the objects into the history vector.
         // Don't work with pointers here!
-        history.emplace_back(lungPrm, branchParams);
+        history.emplace_back(lung, branchParams);
+    }
+
+    template <class F>
+    void writeHistoryRecord(const LungParameters& lung, size_t branchCount, F&& branchAt) {
+        // The file is only opened with the first record, when the number of
+        // branches is known
+        if (!historyWriter.isOpen()) {
+            if (!functionalPrm.detailedHistory) branchCount = 0;
+            if (!historyWriter.open(historyPath.c_str(), branchCount, functionalPrm.historyTrackingRate, externPrm.dt, historyDirectIO)) {
+                historyPath.clear();
+                return;
+            }
+        }
+        if (functionalPrm.detailedHistory && historyWriter.getBranchCount() != branchCount) {
+            std::cout << "ERROR: The number of branches changed, the history file can not hold them. Stopping the history." << std::endl;
+            historyWriter.close();
+            historyPath.clear();
+            return;
+        }
+        historyWriter.write(lung, branchAt);
+    }
+
+    // The state of the lung itself for a checkpoint
+    CheckpointHeader checkpointHeader() {
+        CheckpointHeader header{};
+        header.timeSteps = functionalPrm.timeSteps;
+        header.historyCursor = historyCursor;
+        header.lungPrm = lungPrm;
+        header.externPrm = externPrm;
+        if (functionalPrm.globalParamsEnabled) header.branchPrmGlobal = branchPrmGlobal;
+        else if (!branches.empty()) header.branchPrmGlobal = *branches[0]._getGlobalParameters();
+        return header;
     }
 
+    void writePeriodicCheckpoint() {
+        if (!asyncCheckpoints) {
+            writeCheckpoint(checkpointPath.c_str());
+            return;
+        }
+        // Only the copy happens here, the file is written on the background thread
+        synchronizeBranches();
+        compactBranches();
+        CheckpointSnapshot* snapshot = checkpointWriter.acquire();
+        snapshot->header = checkpointHeader();
+        snapshot->branchParams.resize(branches.size());
+        for (size_t i = 0; i < branches.size(); i++) snapshot->branchParams[i] = *branches[i]._getBranchParameters();
+        snapshot->connections = topology.connectivity.connections();
+        snapshot->multiplicity = multiplicity;
+        checkpointWriter.publish(checkpointPath);
+    }
+
+    // Stores a new branch without touching the lung parameters, returns its index
+    int insertBranch(BranchParameters* _branch_prm, std::vector<int> connections, GlobalBranchParameters* _branch_prm_global)
+    {
+        synchronizeBranches();
+        // Create new branch with params
+        Branch newBranch(_branch_prm_global, *_branch_prm);
+        // Add branch into the list of branches and initialize it
+        branches.push_back(newBranch);
+        int index = topology.connectivity.addBranch();
+        topology.branches = branches.data();
+        branches.back()._setTopology(&topology, index);
+        for (int connection : connections) topology.connectivity.addConnection(index, connection);
+        if (!multiplicity.empty()) multiplicity.push_back(1);
+        topologyVersion++;
+        return index;
+    };
+
+    // This splits one of the copies of its parent off the compressed branch
+    // -index- (see divergeBranch()). The copy gets a copy of the subtree of
+    // the branch, -subtree- and -copies- receive the indices of the branches
+    // of the subtree and of their copies in the same order.
+    void divergeSubtree(int index, std::vector<int32_t>& subtree, std::vector<int32_t>& copies)
+    {
+        subtree.clear();
+        copies.clear();
+        if (multiplicity.empty()) return;
+        int parent = topology.connectivity.parent(index);
+        uint64_t perParent = parent != BranchConnectivity::none ? multiplicity[parent] : 1;
+        uint64_t count = multiplicity[index] / perParent;
+        if (count <= 1) return;
+        // The pending history records and checkpoints still have the old branches
+        asyncHistory.flush();
+        checkpointWriter.flush();
+
+        // The subtree in preorder, the parents come before their children.
+        // -parentPosition[k]- is the position of the parent of subtree[k].
+        const IndexLists& children = topology.connectivity.children();
+        std::vector<int32_t> parentPosition;
+        std::vector<std::pair<int32_t, int32_t>> stack{{index, -1}};
+        while (!stack.empty()) {
+            auto [branch, position] = stack.back();
+            stack.pop_back();
+            parentPosition.push_back(position);
+            subtree.push_back(branch);
+            for (uint32_t j = children.count(branch); j-- > 0;) {
+                int32_t child = children.data(branch)[j];
+                if (topology.connectivity.parent(child) == branch) stack.push_back({child, int32_t(subtree.size() - 1)});
+            }
+        }
+
+        // Every branch of the subtree hands 1 / -count- of its branches to its
+        // copy, the volume of the lung stays the same
+        for (size_t k = 0; k < subtree.size(); k++) {
+            int32_t branch = subtree[k];
+            int32_t copyParent = k > 0 ? copies[parentPosition[k]] : parent;
+            std::vector<int> connections;
+            if (copyParent != BranchConnectivity::none) connections.push_back(copyParent);
+            BranchParameters prm = *branches[branch]._getBranchParameters();
+            int copy = insertBranch(&prm, connections, branches[branch]._getGlobalParameters());
+            // The branches set themselves up when they are created, the copy
+            // has to be in exactly the same state
+            *branches[copy]._getBranchParameters() = prm;
+            multiplicity[copy] = multiplicity[branch] / count;
+            multiplicity[branch] -= multiplicity[copy];
+            copies.push_back(copy);
+        }
+        deltaHistory.invalidate();
+    };
+
 public:
     LungParameters* _getLungParams() { return &lungPrm; };
-    std::vector<HistoryPair>* _getHistory() { return &history; };
+    ExternalParameters* _getExternParams() { return &externPrm; };
+    // Per phase times and branch counts, only filled with -DLUNG_PROFILING
+    LungProfiler* _getProfiler() { return &profiler; };
+    std::vector<HistoryPair>* _getHistory() { asyncHistory.flush(); return &history; };
 
     void trackHistory(int trackingRate = 1, bool detailed = false) {
+        if constexpr (!Policy::hasHistory)
+            if (trackingRate > 0) std::cout << "WARNING: This lung is compiled without history, no history will be recorded" << std::endl;
+        asyncHistory.flush();
         functionalPrm.historyTrackingRate = trackingRate;
         functionalPrm.detailedHistory = detailed;
+        functionalPrm.deltaHistory = false;
+    };
+
+    // This is a detailed history that only stores the branches that changed
+    // since the previous history event, plus a full copy of all branches every
+    // -keyframeInterval- events. The lung parameters are stored in the history
+    // as usual, the branch parameters are reconstructed with getBranchHistory().
+    void trackDeltaHistory(int trackingRate = 1, int keyframeInterval = 1000) {
+        trackHistory(trackingRate, false);
+        functionalPrm.deltaHistory = true;
+        deltaHistory.reset(keyframeInterval);
+    };
+
+    DeltaHistory* _getDeltaHistory() { asyncHistory.flush(); return &deltaHistory; };
+
+    // The branch parameters at the last history event at or before -step-
+    // (counting from 1), returns false if there was none
+    bool getBranchHistory(int step, std::vector<BranchParameters>& branchParams) {
+        asyncHistory.flush();
+        size_t record;
+        if (!functionalPrm.deltaHistory || !deltaHistory.findRecord(step, record)) return false;
+        deltaHistory.reconstruct(record, branchParams);
+        return true;
+    };
+
+    // This moves the history out of the time step: the time step only copies
+    // the parameters into one of -slots- preallocated snapshots and a background
+    // thread stores them in the history (or the history file, or the delta
+    // history). With HistoryBackPressure::Block the time step waits if all
+    // slots are taken, with HistoryBackPressure::Drop the record is lost, see
+    // _getDroppedHistoryCount(). The history getters wait for the background
+    // thread to catch up.
+    void captureHistoryAsync(bool enable = true, int slots = 8, HistoryBackPressure policy = HistoryBackPressure::Block) {
+        asyncHistory.stop();
+        if (!enable) return;
+        bool withBranches = functionalPrm.detailedHistory || functionalPrm.deltaHistory;
+        asyncHistory.start(slots, withBranches ? branches.size() : 0, policy, [this](const HistorySnapshot& snapshot) {
+            storeHistoryRecord(snapshot.timeStep, snapshot.lungPrm, snapshot.branchCount, [&](size_t i) -> const BranchParameters& { return snapshot.branchParams[i]; });
+        });
+    };
+
+    size_t _getDroppedHistoryCount() { return asyncHistory.getDroppedCount(); };
+
+    // This streams the history into a file instead of keeping it in memory, so
+    // the memory usage stays the same no matter how long the simulation runs.
+    // The file can be read with the HistoryReader, see historyWriter.h.
+    // With -directIO- the writes bypass the page cache.
+    void streamHistory(std::string path, int trackingRate = 1, bool detailed = false, bool directIO = false) {
+        closeHistory();
+        trackHistory(trackingRate, detailed);
+        historyPath = path;
+        historyDirectIO = directIO;
+    };
+
+    // Writes the rest of the streamed history to the file and closes it, this
+    // also happens when the lung is destroyed
+    void closeHistory() {
+        asyncHistory.flush();
+        historyWriter.close();
+        historyPath.clear();
+    };
+
+    // An observable reduces the branches to a few values (e.g. per layer, see
+    // layerObservables.h) during the branch update, without copying them. The
+    // values of all observables are recorded every -rate- steps in
+    // _getObservableSeries(). Only the branches that change in a step are seen
+    // by the observables, so they cost next to nothing.
+    void addObservable(std::unique_ptr<Observable> observable) {
+        if (observables.add(std::move(observable))) observablesVersion = -1;
+    };
+
+    void sampleObservables(int rate) { observables.setRate(rate); };
+    ObservableSeries* _getObservableSeries() { return observables._getSeries(); };
+
+    // Publishes the lung parameters and the values of the observables every
+    // -rate- steps into the POSIX shared memory -name- (e.g. "/lung"), where
+    // the telemetry tool (./tools/telemetry.cpp) or a TelemetryReader can
+    // watch the running simulation. Only the observable -columns- are
+    // published (e.g. "V.layer3"), all of them if it is empty. The segment is
+    // a ring of the last -slots- records, the step never waits for a reader.
+    void publishTelemetry(std::string name, int rate = 1, std::vector<std::string> columns = {}, int slots = 1024) {
+        closeTelemetry();
+        if (rate <= 0) return;
+        if (name.empty() || name[0] != '/') name = "/" + name;
+        telemetryName = name;
+        telemetryRate = rate;
+        telemetryColumns = columns;
+        telemetrySlots = slots;
+        // A reader started from now on waits for the new segment instead of
+        // reading the one of an earlier run
+        removeTelemetry(name);
+    };
+
+    // Marks the telemetry as finished, the segment stays until a reader
+    // removes it. This also happens when the lung is destroyed.
+    void closeTelemetry() {
+        telemetry.close();
+        telemetryRate = 0;
+    };
+
+    // Only update the branches that can still change, see frontierUpdateBranches()
+    void useFrontierStepping(bool enable = true) {
+        functionalPrm.frontierStepping = enable;
     };
 
     // Only use threading if you can make sure that your branch update is
     // independent of other branch updates!
-    void useThreading(int threadCount = 4) {
-        functionalPrm.useMultithreading = threadCount;
+    // The -grain- is the number of branches a thread takes at once, smaller
+    // values balance better, bigger values have less overhead.
+    void useThreading(int threadCount = 4, int grain = 1024) {
+        if constexpr (!Policy::hasThreading)
+            std::cout << "WARNING: This lung is compiled without threading, the branches are updated serially" << std::endl;
+        else {
+            threadPool.resize(threadCount);
+            threadSums.resize(threadPool.size());
+            functionalPrm.useMultithreading = threadPool.size();
+            functionalPrm.threadingGrain = grain;
+        }
     };
 
     // These are the initializers for the class. If there is a need of additional
@@ -126,8 +763,9 @@ public:
         init();
     };
 
-    // The following two functions will initialize a new branch and store it in
-    // the branches vector of this class
+    // The following functions will initialize a new branch and store it in
+    // the branches vector of this class. The connections can either be given
+    // as pointers to branches of this lung or by their index.
     inline Branch* addBranch(BranchParameters* _branch_prm, Branch* _connection)
     {
         if (functionalPrm.globalParamsEnabled)
@@ -148,55 +786,390 @@ public:
         return nullptr;
     };
 
-    inline Branch* addBranch(BranchParameters* _branch_prm, Branch* _connection, GlobalBranchParameters* _branch_prm_global)
+    inline int addBranch(BranchParameters* _branch_prm, std::vector<int> connections)
     {
-        // Create new branch with params
-        Branch newBranch(_branch_prm_global, *_branch_prm);
-        // Add branch into the list of branches and initialize it
-        branches.push_back(newBranch);
-        branches.back().addConnection(_connection);
-
-        // Adjustments to the lung parameters with the new branch
-        lungPrm.addBranchAdjustments(branches.back()._getBranchParameters());
+        if (functionalPrm.globalParamsEnabled)
+            return addBranch(_branch_prm, connections, &branchPrmGlobal);
+        else
+            std::cout << "ERROR: Global params not defined! Please use the other add_branch overload." << std::endl;
+        exit(1);
+        return -1;
+    };
 
-        return &branches.back();
+    inline Branch* addBranch(BranchParameters* _branch_prm, Branch* _connection, GlobalBranchParameters* _branch_prm_global)
+    {
+        std::vector<int> connections;
+        if (_connection) connections.push_back(_connection->_getIndex());
+        return &branches[addBranch(_branch_prm, connections, _branch_prm_global)];
     }
 
     inline Branch* addBranch(BranchParameters* _branch_prm, std::vector<Branch*> connections, GlobalBranchParameters* _branch_prm_global)
     {
-        // Create new branch with params
-        Branch newBranch(_branch_prm_global, *_branch_prm);
-        // Add branch into the list of branches and initialize it
-        branches.push_back(newBranch);
-        branches.back().addConnections(connections);
+        // The pointers become invalid once the branches vector reallocates, so
+        // they are turned into indices before the new branch is stored
+        std::vector<int> indices;
+        indices.reserve(connections.size());
+        for (Branch* connection : connections) indices.push_back(connection->_getIndex());
+        return &branches[addBranch(_branch_prm, indices, _branch_prm_global)];
+    };
+
+    inline int addBranch(BranchParameters* _branch_prm, std::vector<int> connections, GlobalBranchParameters* _branch_prm_global)
+    {
+        int index = insertBranch(_branch_prm, connections, _branch_prm_global);
 
         // Adjustments to the lung parameters with the new branch
         lungPrm.addBranchAdjustments(branches.back()._getBranchParameters());
 
-        return &branches.back();
+        return index;
     };
 
-    void removeBranch(Branch* _branch)
+    inline void addBranches(const BranchParameters* _branch_prm, size_t count, const uint64_t* connectionBegin, const int32_t* connections)
     {
-        for (int i = 0; i < branches.size(); i++)
-        {
-            // Remove all connections to the branch that is getting deleted
-            for (int j = 0; j < branches[i].getConnections().size(); j++)
-            {
-                if (branches[i].getConnections()[j] == _branch) branches[i].deleteConnection(_branch);
-            }
+        if (functionalPrm.globalParamsEnabled)
+            return addBranches(_branch_prm, count, connectionBegin, connections, &branchPrmGlobal);
+        else
+            std::cout << "ERROR: Global params not defined! Please use the other addBranches overload." << std::endl;
+        exit(1);
+    };
+
+    // This adds -count- branches at once, which is much faster than adding them
+    // one by one. The connections of new branch k are the branch indices
+    // -connections-[connectionBegin[k], connectionBegin[k + 1]), counted from
+    // the first new branch. New branch k stands for -_multiplicity[k]-
+    // branches, see addCompressedBranches(), or for itself without it.
+    void addBranches(const BranchParameters* _branch_prm, size_t count, const uint64_t* connectionBegin, const int32_t* connections, GlobalBranchParameters* _branch_prm_global, const uint64_t* _multiplicity = nullptr)
+    {
+        synchronizeBranches();
+        size_t first = branches.size();
+        branches.reserve(first + count);
+        for (size_t k = 0; k < count; k++) branches.emplace_back(_branch_prm_global, _branch_prm[k]);
+        topology.connectivity.addBranches(count, connectionBegin, connections);
+        topology.branches = branches.data();
 
-            lungPrm.removeBranchAdjustments(_branch->_getBranchParams());
+        // The branches that are already there stand for themselves
+        if (_multiplicity || !multiplicity.empty()) multiplicity.resize(first + count, 1);
+        if (_multiplicity) std::copy(_multiplicity, _multiplicity + count, multiplicity.begin() + first);
+
+        for (size_t i = first; i < branches.size(); i++) {
+            branches[i]._setTopology(&topology, int32_t(i));
+            lungPrm.addBranchAdjustments(branches[i]._getBranchParameters(), getMultiplicity(int(i)));
+        }
+        topologyVersion++;
+    };
+
+    // Symmetric trees are mostly made of identical subtrees, which go through
+    // exactly the same states. A compressed lung only stores one of them, and
+    // every branch stands for -multiplicity- branches of the full tree: its
+    // volume changes count that many times, so the lung goes through exactly
+    // the same states as the full tree, at the cost of the compressed one.
+    // The branch functions of the lung (history, structure files, ...) see the
+    // compressed branches, use getMultiplicity() to weigh them. A branch that
+    // has to differ from the others it stands for can be split off with
+    // divergeBranch() or expandBranch(). See subtreeCompression.h for how
+    // the tree is compressed.
+    void addCompressedBranches(const CompressedTree& tree)
+    {
+        if (functionalPrm.globalParamsEnabled)
+            return addCompressedBranches(tree, &branchPrmGlobal);
+        else
+            std::cout << "ERROR: Global params not defined! Please use the other addCompressedBranches overload." << std::endl;
+        exit(1);
+    };
+
+    void addCompressedBranches(const CompressedTree& tree, GlobalBranchParameters* _branch_prm_global)
+    {
+        addBranches(tree.branchParams.data(), tree.size(), tree.connectionBegin.data(), tree.connections.data(), _branch_prm_global, tree.multiplicity.data());
+    };
+
+    // This compresses the branches of the lung, see addCompressedBranches().
+    // The lung has to be a tree with the parents before their children, which
+    // share the same global parameters. Works in the middle of a simulation as
+    // well, the branch indices change.
+    bool compressBranches()
+    {
+        if (!multiplicity.empty()) {
+            std::cout << "ERROR: The lung is compressed already" << std::endl;
+            return false;
+        }
+        synchronizeBranches();
+        compactBranches();
+        if (branches.empty()) return true;
+        GlobalBranchParameters* _branch_prm_global = branches[0]._getGlobalParameters();
+        for (size_t i = 0; i < branches.size(); i++) {
+            if (branches[i]._getGlobalParameters() == _branch_prm_global) continue;
+            std::cout << "ERROR: Only branches with the same global parameters can be compressed" << std::endl;
+            return false;
+        }
 
-            // Finally remove the branch from the list of branches
-            if (&branches[i] == _branch) branches.erase(branches.begin() + i);
+        const IndexLists& connections = topology.connectivity.connections();
+        std::vector<uint64_t> connectionBegin(branches.size() + 1, 0);
+        std::vector<int32_t> targets;
+        for (size_t i = 0; i < branches.size(); i++) {
+            targets.insert(targets.end(), connections.data(int32_t(i)), connections.data(int32_t(i)) + connections.count(int32_t(i)));
+            connectionBegin[i + 1] = targets.size();
         }
+        CompressedTree tree;
+        if (!compressSubtrees(branches.size(), [&](size_t i) -> const BranchParameters& { return *branches[i]._getBranchParameters(); },
+                              connectionBegin.data(), targets.data(), tree))
+            return false;
+
+        asyncHistory.flush();
+        checkpointWriter.flush();
+        LungParameters state = lungPrm;
+        // The branches were synchronized above, whatever the model keeps of
+        // them must not be written back into the compressed ones
+        topologyVersion++;
+        branches.clear();
+        topology.connectivity = BranchConnectivity();
+        addCompressedBranches(tree, _branch_prm_global);
+        // The branches set themselves up when they are created, the state of
+        // the lung overrides that
+        for (size_t i = 0; i < branches.size(); i++) *branches[i]._getBranchParameters() = tree.branchParams[i];
+        lungPrm = state;
+        deltaHistory.invalidate();
+        return true;
+    };
+
+    bool isCompressed() { return !multiplicity.empty(); };
+    // The number of branches of the full tree branch -index- stands for
+    uint64_t getMultiplicity(int index) { return multiplicity.empty() ? 1 : multiplicity[index]; };
+    // The number of branches of the full tree
+    uint64_t getRepresentedBranchCount() {
+        if (multiplicity.empty()) return branches.size() - topology.connectivity.tombstoneCount();
+        uint64_t count = 0;
+        for (size_t i = 0; i < branches.size(); i++) if (topology.connectivity.isAlive(int32_t(i))) count += multiplicity[i];
+        return count;
+    };
+
+    // A compressed branch with the parent P stands for the same number of
+    // branches under every branch P stands for. This splits one of them off
+    // (together with its subtree) and returns its index, it stands for one
+    // branch under every branch of P. If there is nothing to split off the
+    // branch itself is returned. The branch indices stay valid.
+    int divergeBranch(int index)
+    {
+        std::vector<int32_t> subtree, copies;
+        divergeSubtree(index, subtree, copies);
+        return copies.empty() ? index : copies[0];
+    };
+
+    // This splits the branches on the way from the root to branch -index-
+    // until there is a branch that only stands for one branch of the full
+    // tree and returns it. Its parameters can then be changed without
+    // changing any other branch.
+    int expandBranch(int index)
+    {
+        if (multiplicity.empty()) return index;
+        std::vector<int32_t> path;
+        for (int branch = index; branch != BranchConnectivity::none; branch = topology.connectivity.parent(branch)) path.push_back(branch);
+        std::reverse(path.begin(), path.end());
+
+        // -path[k]- is replaced by its copy whenever a branch above it is split
+        std::vector<int32_t> subtree, copies;
+        for (size_t k = 0; k < path.size(); k++) {
+            divergeSubtree(path[k], subtree, copies);
+            if (copies.empty()) continue;
+            for (size_t j = k; j < path.size(); j++)
+                path[j] = copies[std::find(subtree.begin(), subtree.end(), path[j]) - subtree.begin()];
+        }
+        return path.back();
+    };
+
+    Branch* _getBranch(int index) { return &branches[index]; };
+    int getBranchCount() { return (int)branches.size(); };
+
+    // Removing a branch deletes all connections from and to it. The branch is
+    // only marked as removed and all of them are dropped at once before the
+    // next update, so pointers to branches stay valid until then.
+    void removeBranch(Branch* _branch) { removeBranch(_branch->_getIndex()); };
+    void removeBranch(int index)
+    {
+        if constexpr (Policy::hasStaticTopology) {
+            std::cout << "ERROR: Branches can not be removed from a lung with a static topology" << std::endl;
+            return;
+        }
+        if (!topology.connectivity.isAlive(index)) return;
+        synchronizeBranches();
+        topology.connectivity.removeBranch(index);
+        lungPrm.removeBranchAdjustments(branches[index]._getBranchParameters(), getMultiplicity(index));
+        topologyVersion++;
+    }
+
+    // Drops the removed branches from the branches vector and the connectivity,
+    // the remaining branches keep their order
+    void compactBranches()
+    {
+        if constexpr (Policy::hasStaticTopology) return;
+        if (topology.connectivity.tombstoneCount() == 0) return;
+        std::vector<int32_t> remap = topology.connectivity.compact();
+
+        size_t next = 0;
+        for (size_t i = 0; i < branches.size(); i++) {
+            if (remap[i] == BranchConnectivity::none) continue;
+            if (next != i) branches[next] = branches[i];
+            if (!multiplicity.empty()) multiplicity[next] = multiplicity[i];
+            next++;
+        }
+        branches.erase(branches.begin() + next, branches.end());
+        if (!multiplicity.empty()) multiplicity.resize(next);
+
+        topology.branches = branches.data();
+        for (size_t i = 0; i < branches.size(); i++) branches[i]._setTopology(&topology, int32_t(i));
+        topologyVersion++;
+    }
+
+    // This stores the branches in the given order (see BranchLayout), so a
+    // branch and the branches connected to it are close to each other in
+    // memory. With BranchLayout::DepthFirst every subtree is a contiguous range
+    // of branches, so the ranges the threads work on are subtrees as well.
+    // Returns the new index of every branch. Pointers to branches and indices
+    // kept outside of the lung do not follow the branches.
+    std::vector<int32_t> reorderBranches(BranchLayout order = BranchLayout::DepthFirst)
+    {
+        synchronizeBranches();
+        compactBranches();
+        // The pending history records and checkpoints are in the old order
+        asyncHistory.flush();
+        checkpointWriter.flush();
+        std::vector<int32_t> remap = topology.connectivity.layout(order);
+        topology.connectivity.permute(remap);
+
+        std::vector<Branch> reordered(branches);
+        for (size_t i = 0; i < branches.size(); i++) reordered[remap[i]] = branches[i];
+        branches.swap(reordered);
+        if (!multiplicity.empty()) {
+            std::vector<uint64_t> reorderedMultiplicity(multiplicity.size());
+            for (size_t i = 0; i < multiplicity.size(); i++) reorderedMultiplicity[remap[i]] = multiplicity[i];
+            multiplicity.swap(reorderedMultiplicity);
+        }
+
+        topology.branches = branches.data();
+        for (size_t i = 0; i < branches.size(); i++) branches[i]._setTopology(&topology, int32_t(i));
+        topologyVersion++;
+
+        // The next record of the delta history has to be a keyframe
+        deltaHistory.invalidate();
+        return remap;
     }
 
     // virtual public member functions
     virtual inline void timeStep(TimeStepParameters* q) = 0;
 
+    // Runs -nSteps- time steps with the time step parameters -q[n]- of every
+    // step, models can override this with a loop that avoids the virtual call
+    virtual void run(int nSteps, const TimeStepParameters* q) {
+        for (int n = 0; n < nSteps; n++) timeStep(const_cast<TimeStepParameters*>(q + n));
+    };
+
+    // The structure of the lung, i.e. all branches and their connections, can be
+    // stored in a binary structure file (see structureFile.h). Reading it adds
+    // all branches of the file at once to this lung.
+    bool writeStructureToFile(const char* path) {
+        synchronizeBranches();
+        compactBranches();
+        if (!multiplicity.empty())
+            std::cout << "WARNING: The structure file only holds the branches of the compressed lung, not their multiplicity. Use a checkpoint to keep it." << std::endl;
+        return writeStructureFile(path, branches.size(), [&](size_t i) -> const BranchParameters& { return *branches[i]._getBranchParameters(); }, topology.connectivity.connections());
+    };
+
+    bool readStructureFromFile(const char* path) {
+        if (!functionalPrm.globalParamsEnabled) {
+            std::cout << "ERROR: Global params not defined! Please use the other readStructureFromFile overload." << std::endl;
+            exit(1);
+        }
+        return readStructureFromFile(path, &branchPrmGlobal);
+    };
+
+    bool readStructureFromFile(const char* path, GlobalBranchParameters* _branch_prm_global) {
+        // The tables are used right from the mapped file
+        StructureReader reader;
+        if (!reader.open(path)) return false;
+        addBranches(reader.branchParameters(), reader.size(), reader.connectionBegin(), reader.connections(), _branch_prm_global);
+        return true;
+    };
+
+    // A checkpoint holds the complete state of the lung: the lung, external and
+    // global branch parameters, all branches with their connections (and their
+    // multiplicity if the lung is compressed), the number of time steps and
+    // the history cursor. Restoring it replaces all
+    // branches of this lung, the lung continues exactly like the one that
+    // wrote the checkpoint. The history itself and the settings of the lung
+    // (threading, history tracking, ...) are not part of the checkpoint.
+    bool writeCheckpoint(const char* path) {
+        synchronizeBranches();
+        compactBranches();
+        return writeCheckpointFile(path, checkpointHeader(), branches.size(), [&](size_t i) -> const BranchParameters& { return *branches[i]._getBranchParameters(); }, topology.connectivity.connections(),
+                                   multiplicity.empty() ? nullptr : multiplicity.data());
+    };
+
+    bool readCheckpoint(const char* path) {
+        CheckpointReader reader;
+        return reader.open(path) && readCheckpoint(reader);
+    };
+
+    // The branches are created right from the mapped file of -reader-, which
+    // can be used for any number of lungs, e.g. to fork many runs from one
+    // warm checkpoint
+    bool readCheckpoint(const CheckpointReader& reader) {
+        if (!functionalPrm.globalParamsEnabled) {
+            std::cout << "ERROR: Global params not defined! Please use the other readCheckpoint overload." << std::endl;
+            exit(1);
+        }
+        branchPrmGlobal = reader.getHeader().branchPrmGlobal;
+        return readCheckpoint(reader, &branchPrmGlobal);
+    };
+
+    // The branches use -_branch_prm_global-, the global parameters stored in the
+    // checkpoint are ignored
+    bool readCheckpoint(const CheckpointReader& reader, GlobalBranchParameters* _branch_prm_global) {
+        const CheckpointHeader& header = reader.getHeader();
+        const StructureReader& structure = reader.getStructure();
+        asyncHistory.flush();
+        checkpointWriter.flush();
+
+        // The old branches are replaced, so whatever the model keeps of them
+        // (e.g. the structure of arrays) must not be written back into the new ones
+        topologyVersion++;
+        branches.clear();
+        multiplicity.clear();
+        topology.connectivity = BranchConnectivity();
+        addBranches(structure.branchParameters(), structure.size(), structure.connectionBegin(), structure.connections(), _branch_prm_global, reader.getMultiplicity());
+        // The branches set themselves up when they are created, the state of
+        // the checkpoint overrides that
+        for (size_t i = 0; i < branches.size(); i++) *branches[i]._getBranchParameters() = structure.branchParameters()[i];
+
+        lungPrm = header.lungPrm;
+        externPrm = header.externPrm;
+        functionalPrm.timeSteps = header.timeSteps;
+        historyCursor = header.historyCursor;
+        deltaHistory.invalidate();
+        return true;
+    };
+
+    // Writes a checkpoint to -path- every -rate- steps (0 turns it off). With
+    // -async- the state is copied at the step and written on a background
+    // thread. The checkpoint is replaced only by a complete one, so -path-
+    // always holds the last complete checkpoint.
+    void checkpointPeriodically(std::string path, int rate, bool async = true) {
+        checkpointWriter.flush();
+        checkpointPath = path;
+        functionalPrm.checkpointRate = path.empty() ? 0 : rate;
+        asyncCheckpoints = async;
+    };
+
+    // Waits until the last periodic checkpoint is written
+    void flushCheckpoints() { checkpointWriter.flush(); };
+
+    // The number of history events since the start of the simulation, a
+    // restored lung counts on from the value of its checkpoint
+    size_t getHistoryCursor() { return historyCursor; };
+
     virtual void readStructureFromFile(std::ifstream* i) {
-        std::cout << "Structure reader has to be implemented into the derived classes in order to use them.";
+        if (!functionalPrm.globalParamsEnabled) {
+            std::cout << "ERROR: Global params not defined! Please use the file path overload of readStructureFromFile." << std::endl;
+            exit(1);
+        }
+        StructureReader reader;
+        if (reader.open(*i)) addBranches(reader.branchParameters(), reader.size(), reader.connectionBegin(), reader.connections(), &branchPrmGlobal);
     };
 };
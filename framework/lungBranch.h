@@ -10,8 +10,16 @@
 #include <vector>
 #include <random>
 #include "lung.h"
+#include "connectivity.h"
 #include "model_params.h"
 
+// This is the base of every branch model. There are no virtual functions in
+// here: the lung stores the branches by their model type and calls their
+// functions directly, so the branches do not need a vtable and the branch
+// update can be inlined into the loops of the lung. Every model has to
+// implement
+//   double timeStep(ExternalParameters*, LungParameters*, TimeStepParameters*)
+// and can hide init() and isActive() with its own versions.
 template <class Branch>
 class LungBranch {
 protected:
@@ -19,47 +27,57 @@ protected:
     // and use getters and setters instead for more control
     BranchParameters prm;
     GlobalBranchParameters* _prm_global;
-    std::vector<Branch*> _connections;
 
-    virtual void init() { prm.init(); };
+    // The connections are stored by index in the topology of the lung, so they
+    // stay valid when the branches move in memory
+    BranchTopology<Branch>* _topology = nullptr;
+    int32_t _index = BranchConnectivity::none;
+
+    void init() { prm.init(); };
 public:
     // Getters for private variables (minimizing direct access)
     BranchParameters* _getBranchParameters() { return &prm; };
     GlobalBranchParameters* _getGlobalParameters() { return _prm_global; };
-    std::vector<Branch*> getConnections() { return _connections; };
-    Branch* _getConnection()
+    int _getIndex() { return _index; };
+    ConnectionList<Branch> getConnections()
+    {
+        if (!_topology) return ConnectionList<Branch>();
+        const IndexLists& connections = _topology->connectivity.connections();
+        return ConnectionList<Branch>(_topology->branches, connections.data(_index), connections.count(_index));
+    };
+    inline int _getConnectionIndex()
+    {
+        if (!_topology) return BranchConnectivity::none;
+        return _topology->connectivity.parent(_index);
+    };
+    inline Branch* _getConnection()
     {
-        if (_connections.size() > 0)
-            return _connections[0];
+        int connection = _getConnectionIndex();
+        if (connection != BranchConnectivity::none)
+            return _topology->branches + connection;
         else return nullptr;
     }
 
     // General setup of the branch with an abstract set of parameters defined in "model_params.h"
     LungBranch(GlobalBranchParameters* _prm_global, BranchParameters prm) : _prm_global(_prm_global), prm(prm) { init(); };
 
-    // This adds the pointer of another branch to a vector of LungBranch pointers:
-    // BEWARE OF MEMORY REALLOCATION! -> the _connections vector needs to have
-    // enough memory allocated *before* pushing connections into it
+    // This is called by the lung when the branch is stored in it or moved to
+    // another index
+    void _setTopology(BranchTopology<Branch>* _topology, int32_t index) { this->_topology = _topology; _index = index; };
+
+    // This connects this branch to another branch of the same lung. The first
+    // connection of a branch is considered its parent.
     inline void addConnections(std::vector<Branch*> branches) { for (auto b : branches) { addConnection(b); }}
-    void addConnection(Branch* _branch) { _connections.push_back(_branch); };
+    void addConnection(Branch* _branch) { if (_branch) _topology->connectivity.addConnection(_index, _branch->_getIndex()); };
 
     // This deletes a connection between two lung branches
-    void deleteConnection(Branch* _branch)
-    {
-        for (int i = 0; i < _connections.size(); i++)
-        {
-            if (_connections[i] == _branch)
-            {
-                _connections.erase(_connections.begin() + i);
-                return;
-            }
-        };
-    };
+    void deleteConnection(Branch* _branch) { _topology->connectivity.deleteConnection(_index, _branch->_getIndex()); };
 
     // This deletes all connections of this branch
-    void deleteConnections() { _connections.clear(); };
+    void deleteConnections() { _topology->connectivity.deleteConnections(_index); };
 
-    // This has to be implemented for each individual model and makes this a
-    // fully virtual class
-    virtual inline void timeStep(ExternalParameters* _extern_params, LungParameters* _lung_params, TimeStepParameters* q) = 0;
+    // A branch is active if its next time step can change it. Models that want
+    // to use frontier stepping implement this, a branch that is not active may
+    // only become active once one of its connections stops being active.
+    inline bool isActive() { return true; };
 };
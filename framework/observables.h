@@ -0,0 +1,158 @@
+//
+//  observables.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 17.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "model_params.h"
+
+// The branches of a lung as the observables see them when they are reset
+struct ObservedBranches {
+    size_t count;
+    std::function<const BranchParameters&(size_t)> branchAt;
+    // The number of branches of the full tree branch i stands for, see
+    // Lung::addCompressedBranches()
+    std::function<uint64_t(size_t)> multiplicityAt;
+};
+
+// An observable reduces the branches of a lung to a few values, e.g. one per
+// layer, while the branches are updated. It is reset with all branches once,
+// after that it only sees the branches that changed their volume or opened in
+// a step (a branch at V_max opens with dV = 0), so it costs
+// nothing for the branches that do not change (and works with frontier
+// stepping). The observations come from all threads of the update at once,
+// every thread has to use its own accumulator, endStep() merges them.
+class Observable {
+public:
+    virtual ~Observable() {};
+
+    // Used as the prefix of the columns in the time series
+    virtual std::string name() = 0;
+    // The names of the values, fixed after the first reset()
+    virtual std::vector<std::string> columns() = 0;
+
+    // Called before the first step and whenever the branches or the number
+    // of threads changed, the observable starts over from the current state
+    virtual void reset(const ObservedBranches& branches, int threads) = 0;
+
+    // Branch -branch- changed its volume by -dV- (or opened with dV = 0) and
+    // is in the state -state- now. Called by thread -thread- during the branch update.
+    virtual void observe(int thread, int branch, double dV, const BranchState& state, uint64_t multiplicity) = 0;
+
+    // Merges the accumulators of the threads, called after every step
+    virtual void endStep() = 0;
+
+    // Writes the current values into -values-, one per column
+    virtual void sample(double* values) = 0;
+};
+
+// The values of all observables, one row every -rate- steps. The row of
+// step s is taken after s steps, the values of a row are in the order of
+// the columns.
+struct ObservableSeries {
+    std::vector<std::string> columns;
+    std::vector<int> steps;
+    std::vector<double> values;
+
+    size_t size() const { return steps.size(); };
+    const double* row(size_t r) const { return values.data() + r * columns.size(); };
+    double at(size_t r, size_t column) const { return values[r * columns.size() + column]; };
+
+    // The index of the column -name-, -1 if there is none
+    int column(const std::string& name) const {
+        for (size_t c = 0; c < columns.size(); c++) if (columns[c] == name) return int(c);
+        return -1;
+    };
+
+    bool writeCSV(const char* path) const {
+        FILE* file = fopen(path, "w");
+        if (!file) {
+            std::cout << "ERROR: Could not open " << path << std::endl;
+            return false;
+        }
+        fprintf(file, "step");
+        for (const std::string& name : columns) fprintf(file, ",%s", name.c_str());
+        fprintf(file, "\n");
+        for (size_t r = 0; r < size(); r++) {
+            fprintf(file, "%d", steps[r]);
+            for (size_t c = 0; c < columns.size(); c++) fprintf(file, ",%.17g", at(r, c));
+            fprintf(file, "\n");
+        }
+        return fclose(file) == 0;
+    };
+};
+
+// The observables of a lung and their time series, see Lung::addObservable()
+class LungObservables {
+public:
+    inline bool isActive() const { return !observables.empty(); };
+
+    bool add(std::unique_ptr<Observable> observable) {
+        if (!series.steps.empty()) {
+            std::cout << "ERROR: Observables can only be added before the first row of the time series" << std::endl;
+            return false;
+        }
+        observables.push_back(std::move(observable));
+        return true;
+    };
+
+    // Records a row every -rate- steps, 0 only keeps the observables up to
+    // date without recording them (e.g. for the telemetry)
+    void setRate(int rate) { this->rate = rate; };
+    int getRate() const { return rate; };
+
+    void reset(const ObservedBranches& branches, int threads) {
+        for (auto& observable : observables) observable->reset(branches, threads);
+        // The columns stay the same once the series has rows
+        if (!series.steps.empty()) return;
+        series.columns.clear();
+        columnCounts.clear();
+        for (auto& observable : observables) {
+            std::vector<std::string> columns = observable->columns();
+            for (const std::string& column : columns) series.columns.push_back(observable->name() + "." + column);
+            columnCounts.push_back(columns.size());
+        }
+    };
+
+    inline void observe(int thread, int branch, double dV, const BranchState& state, uint64_t multiplicity) {
+        for (auto& observable : observables) observable->observe(thread, branch, dV, state, multiplicity);
+    };
+
+    // -step- is the number of steps of the lung so far
+    void endStep(int step) {
+        for (auto& observable : observables) observable->endStep();
+        if (rate <= 0 || step % rate != 0) return;
+        series.steps.push_back(step);
+        sample(series.values);
+    };
+
+    // Appends the current values of all observables to -values-
+    void sample(std::vector<double>& values) {
+        size_t first = values.size();
+        values.resize(first + series.columns.size());
+        for (size_t k = 0; k < observables.size(); k++) {
+            observables[k]->sample(values.data() + first);
+            first += columnCounts[k];
+        }
+    };
+
+    const std::vector<std::string>& getColumns() const { return series.columns; };
+    ObservableSeries* _getSeries() { return &series; };
+
+private:
+    std::vector<std::unique_ptr<Observable>> observables;
+    ObservableSeries series;
+    std::vector<size_t> columnCounts;
+    int rate = 1;
+};
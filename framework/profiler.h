@@ -0,0 +1,315 @@
+//
+//  profiler.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 16.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// The phases of a time step the profiler tells apart
+enum class ProfilePhase { UpdateBranches, UpdateVolume, LungUpdate, History, Count };
+
+static constexpr const char* profilePhaseNames[] = {"updateBranches", "updateVolume", "lungUpdate", "history"};
+
+#ifdef LUNG_PROFILING
+
+// This collects where the time of the time steps goes. It is only compiled in
+// with -DLUNG_PROFILING, otherwise all the LUNG_PROFILE_ macros are empty and
+// the profiler below does nothing.
+//
+// The time is measured in cycles of the time stamp counter (or nanoseconds on
+// other platforms):
+//  - the total time and the number of calls of every ProfilePhase
+//  - the busy time of every thread in the threaded branch updates, the idle
+//    time is the rest of the parallel region, which shows the load imbalance
+//  - the branches visited and opened in every step
+// The phases, the busy spans of the threads and the branch counts are also
+// kept as trace events (up to -maxTraceEvents-), which writeChromeTrace()
+// writes in the Chrome trace format (chrome://tracing or ui.perfetto.dev).
+class LungProfiler {
+public:
+    // The update routines only count the opened branches if this is set
+    static constexpr bool enabled = true;
+
+    // A trace with more events than this only keeps the first ones
+    size_t maxTraceEvents = 1 << 20;
+
+    LungProfiler() { reset(); };
+
+    static inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    };
+
+    void reset() {
+        for (auto& phase : phases) phase = PhaseTotal();
+        threads.clear();
+        events.clear();
+        droppedEvents = 0;
+        steps = 0;
+        branchesVisited = 0;
+        branchesOpened = 0;
+        stepVisited = 0;
+        stepOpened.assign(1, OpenedCount());
+        startTicks = now();
+        startTime = std::chrono::steady_clock::now();
+    };
+
+    // Measures a phase from its construction to its destruction
+    struct Scope {
+        LungProfiler& profiler;
+        ProfilePhase phase;
+        uint64_t start;
+
+        Scope(LungProfiler& profiler, ProfilePhase phase) : profiler(profiler), phase(phase), start(now()) {};
+        ~Scope() { profiler.addPhase(phase, start, now()); };
+    };
+
+    void addPhase(ProfilePhase phase, uint64_t start, uint64_t end) {
+        PhaseTotal& total = phases[int(phase)];
+        total.ticks += end - start;
+        total.calls++;
+        addEvent({profilePhaseNames[int(phase)], 'X', 0, start, end - start, 0, 0});
+    };
+
+    // The threaded branch updates: every chunk a thread works on is added to
+    // its busy time, the idle time of a thread is the time of the whole
+    // parallel region it did not work.
+    void beginParallel(int threadCount) {
+        if ((int)threads.size() < threadCount) threads.resize(threadCount);
+        if ((int)stepOpened.size() < threadCount) stepOpened.resize(threadCount);
+        for (auto& thread : threads) { thread.regionBusy = 0; thread.first = 0; thread.last = 0; }
+        regionStart = now();
+    };
+
+    // Measures one chunk of a thread, the threads only write their own slot
+    struct Chunk {
+        LungProfiler& profiler;
+        int thread;
+        uint64_t start;
+
+        Chunk(LungProfiler& profiler, int thread) : profiler(profiler), thread(thread), start(now()) {};
+        ~Chunk() {
+            uint64_t end = now();
+            ThreadTotal& total = profiler.threads[thread];
+            total.regionBusy += end - start;
+            if (total.first == 0) total.first = start;
+            total.last = end;
+        };
+    };
+
+    void endParallel() {
+        uint64_t regionEnd = now();
+        uint64_t region = regionEnd - regionStart;
+        for (size_t t = 0; t < threads.size(); t++) {
+            ThreadTotal& thread = threads[t];
+            thread.busy += thread.regionBusy;
+            thread.idle += region > thread.regionBusy ? region - thread.regionBusy : 0;
+            if (thread.first != 0) addEvent({"busy", 'X', int(t) + 1, thread.first, thread.last - thread.first, 0, 0});
+        }
+        regions++;
+    };
+
+    // The branch counts, see LUNG_PROFILE_VISITED and LUNG_PROFILE_OPENED
+    void addVisited(size_t count) { stepVisited += count; };
+
+    // The branches can be updated on any thread, every thread counts the
+    // branches it opened in its own slot, they are summed up in endStep().
+    // -thread- is 0 outside of the parallel regions.
+    void addOpened(int thread, uint64_t count) { stepOpened[thread].count += count; };
+
+    void endStep() {
+        uint64_t opened = 0;
+        for (auto& slot : stepOpened) { opened += slot.count; slot.count = 0; }
+        branchesVisited += stepVisited;
+        branchesOpened += opened;
+        addEvent({"branches", 'C', 0, now(), 0, stepVisited, opened});
+        stepVisited = 0;
+        steps++;
+    };
+
+    uint64_t getSteps() const { return steps; };
+    uint64_t getBranchesVisited() const { return branchesVisited; };
+    uint64_t getBranchesOpened() const { return branchesOpened; };
+    double getPhaseSeconds(ProfilePhase phase) const { return toSeconds(phases[int(phase)].ticks); };
+    double getBusySeconds(int thread) const { return thread < (int)threads.size() ? toSeconds(threads[thread].busy) : 0; };
+    double getIdleSeconds(int thread) const { return thread < (int)threads.size() ? toSeconds(threads[thread].idle) : 0; };
+
+    // Prints the totals of the phases, the threads and the branch counts
+    void printSummary(std::ostream& out = std::cout) const {
+        double total = 0;
+        for (auto& phase : phases) total += toSeconds(phase.ticks);
+        char line[160];
+        out << "Profile of " << steps << " time steps" << std::endl;
+        snprintf(line, sizeof(line), "%-16s %12s %12s %8s %14s", "phase", "calls", "total [ms]", "share", "per step [ns]");
+        out << line << std::endl;
+        for (int p = 0; p < int(ProfilePhase::Count); p++) {
+            double seconds = toSeconds(phases[p].ticks);
+            snprintf(line, sizeof(line), "%-16s %12llu %12.3f %7.1f%% %14.1f", profilePhaseNames[p], (unsigned long long)phases[p].calls,
+                     seconds * 1e3, total > 0 ? 100 * seconds / total : 0., steps > 0 ? seconds * 1e9 / steps : 0.);
+            out << line << std::endl;
+        }
+        if (!threads.empty()) {
+            out << std::endl << regions << " parallel regions" << std::endl;
+            snprintf(line, sizeof(line), "%-16s %12s %12s %8s", "thread", "busy [ms]", "idle [ms]", "busy");
+            out << line << std::endl;
+            for (size_t t = 0; t < threads.size(); t++) {
+                double busy = toSeconds(threads[t].busy), idle = toSeconds(threads[t].idle);
+                snprintf(line, sizeof(line), "%-16zu %12.3f %12.3f %7.1f%%", t, busy * 1e3, idle * 1e3, busy + idle > 0 ? 100 * busy / (busy + idle) : 0.);
+                out << line << std::endl;
+            }
+        }
+        out << std::endl << "branches visited " << branchesVisited << " (" << (steps > 0 ? double(branchesVisited) / steps : 0.)
+            << " per step), opened " << branchesOpened << std::endl;
+        if (droppedEvents > 0) out << droppedEvents << " trace events were dropped, see maxTraceEvents" << std::endl;
+    };
+
+    // Writes the trace events in the Chrome trace format, thread 0 is the
+    // thread that runs the time steps, thread t + 1 is worker t of the pool
+    bool writeChromeTrace(const char* path) const {
+        FILE* file = fopen(path, "w");
+        if (!file) {
+            std::cout << "ERROR: Could not open the trace file " << path << std::endl;
+            return false;
+        }
+        fprintf(file, "{\"traceEvents\":[\n");
+        for (size_t i = 0; i < events.size(); i++) {
+            const TraceEvent& event = events[i];
+            double ts = toSeconds(event.start - startTicks) * 1e6;
+            if (event.type == 'X')
+                fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", event.name, event.thread, ts, toSeconds(event.duration) * 1e6);
+            else
+                fprintf(file, "{\"name\":\"%s\",\"ph\":\"C\",\"pid\":0,\"tid\":0,\"ts\":%.3f,\"args\":{\"visited\":%llu,\"opened\":%llu}}", event.name, ts,
+                        (unsigned long long)event.visited, (unsigned long long)event.opened);
+            fprintf(file, i + 1 < events.size() ? ",\n" : "\n");
+        }
+        fprintf(file, "],\"displayTimeUnit\":\"ns\"}\n");
+        bool success = !ferror(file);
+        if (fclose(file) != 0) success = false;
+        if (!success) std::cout << "ERROR: Could not write the trace file " << path << std::endl;
+        return success;
+    };
+
+private:
+    struct PhaseTotal {
+        uint64_t ticks = 0;
+        uint64_t calls = 0;
+    };
+
+    // Every thread has its own cache line
+    struct alignas(64) ThreadTotal {
+        uint64_t busy = 0;
+        uint64_t idle = 0;
+        uint64_t regionBusy = 0;
+        uint64_t first = 0;
+        uint64_t last = 0;
+    };
+
+    struct alignas(64) OpenedCount {
+        uint64_t count = 0;
+    };
+
+    struct TraceEvent {
+        const char* name;
+        char type;
+        int thread;
+        uint64_t start;
+        uint64_t duration;
+        uint64_t visited;
+        uint64_t opened;
+    };
+
+    PhaseTotal phases[int(ProfilePhase::Count)];
+    std::vector<ThreadTotal> threads;
+    std::vector<TraceEvent> events;
+    size_t droppedEvents = 0;
+    uint64_t regionStart = 0;
+    uint64_t regions = 0;
+
+    uint64_t steps = 0;
+    uint64_t branchesVisited = 0;
+    uint64_t branchesOpened = 0;
+    uint64_t stepVisited = 0;
+    std::vector<OpenedCount> stepOpened;
+
+    uint64_t startTicks = 0;
+    std::chrono::steady_clock::time_point startTime;
+
+    void addEvent(const TraceEvent& event) {
+        if (events.size() < maxTraceEvents) events.push_back(event);
+        else droppedEvents++;
+    };
+
+    // The ticks per second are measured over the time since the last reset
+    double toSeconds(uint64_t ticks) const {
+#if defined(__x86_64__) || defined(__i386__)
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        uint64_t elapsed = now() - startTicks;
+        return seconds > 0 && elapsed > 0 ? ticks * seconds / elapsed : 0;
+#else
+        return ticks * 1e-9;
+#endif
+    };
+};
+
+#define LUNG_PROFILE_CONCAT_(a, b) a##b
+#define LUNG_PROFILE_CONCAT(a, b) LUNG_PROFILE_CONCAT_(a, b)
+#define LUNG_PROFILE_PHASE(profiler, phase) LungProfiler::Scope LUNG_PROFILE_CONCAT(lungProfileScope, __LINE__)(profiler, phase)
+#define LUNG_PROFILE_PARALLEL_BEGIN(profiler, threadCount) (profiler).beginParallel(threadCount)
+#define LUNG_PROFILE_CHUNK(profiler, thread) LungProfiler::Chunk LUNG_PROFILE_CONCAT(lungProfileChunk, __LINE__)(profiler, thread)
+#define LUNG_PROFILE_PARALLEL_END(profiler) (profiler).endParallel()
+#define LUNG_PROFILE_VISITED(profiler, count) (profiler).addVisited(count)
+#define LUNG_PROFILE_OPENED(profiler, thread, count) (profiler).addOpened(thread, count)
+#define LUNG_PROFILE_STEP(profiler) (profiler).endStep()
+
+#else
+
+// Without -DLUNG_PROFILING nothing is measured and the macros are empty, the
+// profiler only keeps the interface so code using it still compiles.
+class LungProfiler {
+public:
+    static constexpr bool enabled = false;
+
+    void reset() {};
+    uint64_t getSteps() const { return 0; };
+    uint64_t getBranchesVisited() const { return 0; };
+    uint64_t getBranchesOpened() const { return 0; };
+    double getPhaseSeconds(ProfilePhase) const { return 0; };
+    double getBusySeconds(int) const { return 0; };
+    double getIdleSeconds(int) const { return 0; };
+
+    void printSummary(std::ostream& out = std::cout) const {
+        out << "Profiling is not enabled, compile with -DLUNG_PROFILING" << std::endl;
+    };
+
+    bool writeChromeTrace(const char*) const {
+        std::cout << "ERROR: Profiling is not enabled, compile with -DLUNG_PROFILING" << std::endl;
+        return false;
+    };
+};
+
+#define LUNG_PROFILE_PHASE(profiler, phase)
+#define LUNG_PROFILE_PARALLEL_BEGIN(profiler, threadCount)
+#define LUNG_PROFILE_CHUNK(profiler, thread)
+#define LUNG_PROFILE_PARALLEL_END(profiler)
+#define LUNG_PROFILE_VISITED(profiler, count)
+// The count is still evaluated, it can be the return value of an update
+#define LUNG_PROFILE_OPENED(profiler, thread, count) ((void)(count))
+#define LUNG_PROFILE_STEP(profiler)
+
+#endif
@@ -0,0 +1,225 @@
+//
+//  structureFile.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 16.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "connectivity.h"
+#include "model_params.h"
+
+// This is the layout of a structure file, every table starts at a multiple of
+// 64 bytes:
+//   [header]
+//   [BranchParameters 0]...[BranchParameters branchCount - 1]
+//   [connectionBegin 0]...[connectionBegin branchCount]        (uint64_t)
+//   [connection 0]...[connection connectionCount - 1]          (int32_t)
+// The connections of branch i are the branch indices at
+// [connectionBegin[i], connectionBegin[i + 1]), the first one is its parent.
+struct StructureFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t branchRecordSize;
+    uint64_t branchCount;
+    uint64_t connectionCount;
+    uint64_t branchOffset;
+    uint64_t connectionBeginOffset;
+    uint64_t connectionOffset;
+    uint64_t fileSize;
+    char branchSchema[256];
+};
+
+static constexpr char structureFileMagic[8] = {'L', 'U', 'N', 'G', 'T', 'R', 'E', 'E'};
+// Version 2 checks the branch schema, so files of the other precision (see
+// LUNG_SCALAR) are rejected
+static constexpr uint32_t structureFileVersion = 2;
+
+// Writes the structure at the current position of -file-, the offsets in the
+// header are counted from there. -branchAt(i)- has to return the parameters
+// of branch i.
+template <class F>
+bool writeStructure(FILE* file, size_t branchCount, F&& branchAt, const IndexLists& connections) {
+    auto align = [](uint64_t offset) { return (offset + 63) / 64 * 64; };
+    const size_t chunkSize = 1 << 14;
+
+    StructureFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, structureFileMagic, sizeof(header.magic));
+    header.version = structureFileVersion;
+    header.branchRecordSize = sizeof(BranchParameters);
+    header.branchCount = branchCount;
+    for (size_t i = 0; i < branchCount; i++) header.connectionCount += connections.count(int32_t(i));
+    header.branchOffset = align(sizeof(header));
+    header.connectionBeginOffset = align(header.branchOffset + branchCount * sizeof(BranchParameters));
+    header.connectionOffset = align(header.connectionBeginOffset + (branchCount + 1) * sizeof(uint64_t));
+    header.fileSize = header.connectionOffset + header.connectionCount * sizeof(int32_t);
+    strncpy(header.branchSchema, BranchParameters::schema, sizeof(header.branchSchema) - 1);
+
+    const long base = ftell(file);
+    const char zeros[64] = {};
+    auto pad = [&](uint64_t offset) { fwrite(zeros, 1, offset - (ftell(file) - base), file); };
+    fwrite(&header, sizeof(header), 1, file);
+    pad(header.branchOffset);
+    // The tables are collected in chunks, one fwrite per value is slow
+    std::vector<BranchParameters> branchChunk;
+    branchChunk.reserve(chunkSize);
+    for (size_t i = 0; i < branchCount; i++) {
+        branchChunk.push_back(branchAt(i));
+        if (branchChunk.size() == chunkSize || i + 1 == branchCount) {
+            fwrite(branchChunk.data(), sizeof(BranchParameters), branchChunk.size(), file);
+            branchChunk.clear();
+        }
+    }
+    pad(header.connectionBeginOffset);
+    std::vector<uint64_t> beginChunk;
+    beginChunk.reserve(chunkSize);
+    uint64_t begin = 0;
+    for (size_t i = 0; i <= branchCount; i++) {
+        beginChunk.push_back(begin);
+        if (i < branchCount) begin += connections.count(int32_t(i));
+        if (beginChunk.size() == chunkSize || i == branchCount) {
+            fwrite(beginChunk.data(), sizeof(uint64_t), beginChunk.size(), file);
+            beginChunk.clear();
+        }
+    }
+    pad(header.connectionOffset);
+    std::vector<int32_t> connectionChunk;
+    connectionChunk.reserve(chunkSize);
+    for (size_t i = 0; i < branchCount; i++) {
+        connectionChunk.insert(connectionChunk.end(), connections.data(int32_t(i)), connections.data(int32_t(i)) + connections.count(int32_t(i)));
+        if (connectionChunk.size() >= chunkSize || i + 1 == branchCount) {
+            fwrite(connectionChunk.data(), sizeof(int32_t), connectionChunk.size(), file);
+            connectionChunk.clear();
+        }
+    }
+    return !ferror(file);
+}
+
+// Writes a structure file, see writeStructure()
+template <class F>
+bool writeStructureFile(const char* path, size_t branchCount, F&& branchAt, const IndexLists& connections) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        std::cout << "ERROR: Could not open the structure file " << path << std::endl;
+        return false;
+    }
+    bool success = writeStructure(file, branchCount, branchAt, connections);
+    if (fclose(file) != 0) success = false;
+    if (!success) std::cout << "ERROR: Could not write the structure file " << path << std::endl;
+    return success;
+}
+
+// This gives access to the tables of a structure file without copying them,
+// the file is mapped into memory (or read into a buffer for a stream).
+class StructureReader {
+public:
+    ~StructureReader() { close(); };
+
+    // The structure starts at -offset- in the file, e.g. in a checkpoint
+    bool open(const char* path, uint64_t offset = 0) {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            std::cout << "ERROR: Could not open the structure file " << path << std::endl;
+            return false;
+        }
+        struct stat info;
+        fstat(fd, &info);
+        mappedSize = info.st_size;
+        if (mappedSize >= offset + sizeof(StructureFileHeader))
+            mapped = (char*)mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == nullptr || mapped == MAP_FAILED) {
+            mapped = nullptr;
+            std::cout << "ERROR: Could not map the structure file " << path << std::endl;
+            return false;
+        }
+        // The file is read front to back exactly once
+        madvise(mapped, mappedSize, MADV_SEQUENTIAL);
+        madvise(mapped, mappedSize, MADV_WILLNEED);
+        return validate(mapped + offset, mappedSize - offset);
+    };
+
+    bool open(std::istream& stream) {
+        close();
+        buffer.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+        return validate(buffer.data(), buffer.size());
+    };
+
+    void close() {
+        if (mapped) munmap(mapped, mappedSize);
+        mapped = nullptr;
+        buffer.clear();
+        header = nullptr;
+    };
+
+    size_t size() const { return header->branchCount; };
+    const BranchParameters* branchParameters() const { return (const BranchParameters*)(data + header->branchOffset); };
+    const uint64_t* connectionBegin() const { return (const uint64_t*)(data + header->connectionBeginOffset); };
+    const int32_t* connections() const { return (const int32_t*)(data + header->connectionOffset); };
+
+private:
+    char* mapped = nullptr;
+    size_t mappedSize = 0;
+    std::vector<char> buffer;
+    const char* data = nullptr;
+    const StructureFileHeader* header = nullptr;
+
+    bool validate(const char* data, size_t size) {
+        const StructureFileHeader* header = (const StructureFileHeader*)data;
+        if (size < sizeof(StructureFileHeader) || memcmp(header->magic, structureFileMagic, sizeof(header->magic)) != 0
+            || header->version != structureFileVersion || header->branchRecordSize != sizeof(BranchParameters)
+            || strncmp(header->branchSchema, BranchParameters::schema, sizeof(header->branchSchema)) != 0) {
+            std::cout << "ERROR: This is not a structure file of this model" << std::endl;
+            close();
+            return false;
+        }
+        if (header->fileSize > size) {
+            std::cout << "ERROR: The structure file is incomplete" << std::endl;
+            close();
+            return false;
+        }
+        // Every table has to lie inside of the file and start at a multiple of
+        // its alignment, the counts are checked without overflowing
+        auto fits = [&](uint64_t offset, uint64_t count, uint64_t recordSize, uint64_t alignment) {
+            return offset >= sizeof(StructureFileHeader) && offset % alignment == 0 && offset <= header->fileSize
+                && count <= (header->fileSize - offset) / recordSize;
+        };
+        if (header->branchCount == UINT64_MAX || !fits(header->branchOffset, header->branchCount, sizeof(BranchParameters), alignof(BranchParameters))
+            || !fits(header->connectionBeginOffset, header->branchCount + 1, sizeof(uint64_t), alignof(uint64_t))
+            || !fits(header->connectionOffset, header->connectionCount, sizeof(int32_t), alignof(int32_t))) {
+            std::cout << "ERROR: The tables of the structure file do not fit into the file" << std::endl;
+            close();
+            return false;
+        }
+        this->data = data;
+        this->header = header;
+
+        // Check the connections once, so the lung can trust them
+        const uint64_t* begin = connectionBegin();
+        const int32_t* targets = connections();
+        for (size_t i = 0; i < header->branchCount; i++) {
+            bool valid = begin[i] <= begin[i + 1] && begin[i + 1] <= header->connectionCount;
+            for (uint64_t c = begin[i]; valid && c < begin[i + 1]; c++) valid = targets[c] >= 0 && (uint64_t)targets[c] < header->branchCount;
+            if (!valid) {
+                std::cout << "ERROR: Branch " << i << " of the structure file has invalid connections" << std::endl;
+                close();
+                return false;
+            }
+        }
+        return true;
+    };
+};
@@ -0,0 +1,132 @@
+//
+//  subtreeCompression.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 17.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <utility>
+#include <vector>
+#include "connectivity.h"
+#include "model_params.h"
+
+// A tree in which identical subtrees are only stored once. Every branch stands
+// for -multiplicity- branches of the full tree, e.g. the branches of a
+// generation of a symmetric binary tree are all the same and the whole
+// generation is stored as one branch. The connections are in the format of
+// Lung::addBranches(), see Lung::addCompressedBranches().
+struct CompressedTree {
+    std::vector<BranchParameters> branchParams;
+    std::vector<uint64_t> connectionBegin;
+    std::vector<int32_t> connections;
+    std::vector<uint64_t> multiplicity;
+
+    size_t size() const { return branchParams.size(); };
+
+    void clear() {
+        branchParams.clear();
+        connectionBegin.assign(1, 0);
+        connections.clear();
+        multiplicity.clear();
+    };
+
+    // Appends a branch that stands for -count- branches of the full tree,
+    // -parent- is the index of a branch of this tree or none
+    int32_t add(const BranchParameters& prm, int32_t parent, uint64_t count) {
+        if (connectionBegin.empty()) connectionBegin.push_back(0);
+        branchParams.push_back(prm);
+        if (parent != BranchConnectivity::none) connections.push_back(parent);
+        connectionBegin.push_back(connections.size());
+        multiplicity.push_back(count);
+        return int32_t(branchParams.size() - 1);
+    };
+};
+
+// Two subtrees are the same if their roots have the same key (see
+// BranchParameters::key()) and the same number of children of every kind of
+// subtree, the kinds are numbered in the order they are found
+typedef std::pair<decltype(BranchParameters().key()), std::vector<std::pair<int32_t, uint64_t>>> SubtreeKey;
+
+// This finds the identical subtrees of a tree and stores every one of them
+// only once in -tree-. The tree is given like in Lung::addBranches(),
+// -branchAt(i)- has to return the parameters of branch i. Every branch needs
+// at most one connection, its parent, which has to come before it.
+//
+// The branches of a binary tree model only depend on their own parameters,
+// on their parent and on the lung, so all the branches a compressed branch
+// stands for go through exactly the same states.
+template <class F>
+bool compressSubtrees(size_t count, F&& branchAt, const uint64_t* connectionBegin, const int32_t* connections, CompressedTree& tree) {
+    tree.clear();
+    std::vector<int32_t> parent(count, BranchConnectivity::none);
+    std::vector<uint64_t> childBegin(count + 1, 0);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t connectionCount = connectionBegin[i + 1] - connectionBegin[i];
+        if (connectionCount == 0) continue;
+        int32_t p = connections[connectionBegin[i]];
+        if (connectionCount > 1 || p < 0 || p >= int32_t(i)) {
+            std::cout << "ERROR: Branch " << i << " does not fit into a tree with the parents first, it can not be compressed" << std::endl;
+            return false;
+        }
+        parent[i] = p;
+        childBegin[p + 1]++;
+    }
+
+    // The children of every branch, in the order of the branches
+    for (size_t i = 0; i < count; i++) childBegin[i + 1] += childBegin[i];
+    std::vector<int32_t> children(childBegin[count]);
+    std::vector<uint64_t> next(childBegin.begin(), childBegin.end() - 1);
+    for (size_t i = 0; i < count; i++) if (parent[i] != BranchConnectivity::none) children[next[parent[i]]++] = int32_t(i);
+
+    // The kind of subtree of every branch, from the leaves up. The children
+    // come after their parent, so they already have their kind.
+    std::vector<int32_t> kind(count);
+    std::map<SubtreeKey, int32_t> kinds;
+    std::vector<int32_t> childKinds;
+    for (size_t i = count; i-- > 0;) {
+        childKinds.clear();
+        for (uint64_t c = childBegin[i]; c < childBegin[i + 1]; c++) childKinds.push_back(kind[children[c]]);
+        std::sort(childKinds.begin(), childKinds.end());
+
+        SubtreeKey key(branchAt(i).key(), {});
+        for (int32_t k : childKinds) {
+            if (!key.second.empty() && key.second.back().first == k) key.second.back().second++;
+            else key.second.push_back({k, 1});
+        }
+        kind[i] = kinds.emplace(std::move(key), int32_t(kinds.size())).first->second;
+    }
+
+    // Only the first branch of every kind among the children of a branch is
+    // kept, it stands for all of them. The branches are stored breadth first.
+    struct Entry { int32_t branch; int32_t parent; uint64_t count; };
+    std::vector<Entry> queue;
+    std::vector<int32_t> group;
+    auto addGroups = [&](const int32_t* first, size_t n, int32_t newParent, uint64_t count) {
+        group.clear();
+        size_t start = queue.size();
+        for (size_t c = 0; c < n; c++) {
+            int32_t branch = first[c];
+            auto same = std::find(group.begin(), group.end(), kind[branch]);
+            if (same != group.end()) { queue[start + (same - group.begin())].count += count; continue; }
+            group.push_back(kind[branch]);
+            queue.push_back({branch, newParent, count});
+        }
+    };
+
+    std::vector<int32_t> roots;
+    for (size_t i = 0; i < count; i++) if (parent[i] == BranchConnectivity::none) roots.push_back(int32_t(i));
+    addGroups(roots.data(), roots.size(), BranchConnectivity::none, 1);
+    for (size_t k = 0; k < queue.size(); k++) {
+        Entry entry = queue[k];
+        int32_t index = tree.add(branchAt(entry.branch), entry.parent, entry.count);
+        addGroups(children.data() + childBegin[entry.branch], childBegin[entry.branch + 1] - childBegin[entry.branch], index, entry.count);
+    }
+    return true;
+}
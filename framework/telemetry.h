@@ -0,0 +1,275 @@
+//
+//  telemetry.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 17.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "model_params.h"
+
+// This is the layout of a telemetry segment in the POSIX shared memory: the
+// header is followed by the names of the columns (-columnNameSize- bytes each)
+// and by a ring of -slotCount- slots at -slotOffset-. Record k is written
+// into slot k % slotCount, every slot holds
+//   [TelemetrySlot][double 0]...[double columnCount - 1]
+// The schema string lists the fields of the LungParameters like in the
+// history files.
+struct TelemetryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t lungRecordSize;
+    uint32_t columnCount;
+    uint32_t slotCount;
+    uint64_t slotSize;
+    uint64_t slotOffset;
+    int32_t rate;
+    int32_t pid;
+    double dt;
+    char lungSchema[256];
+    // The number of records published so far and if the publisher is done
+    std::atomic<uint64_t> published;
+    std::atomic<uint32_t> finished;
+};
+
+// Every slot is a seqlock: the sequence is odd while the slot is written and
+// it is increased by two for every record, so slot s holds record k exactly
+// if its sequence is 2 * (k / slotCount + 1).
+struct alignas(64) TelemetrySlot {
+    std::atomic<uint64_t> sequence;
+    int64_t step;
+    LungParameters lungPrm;
+};
+
+static constexpr char telemetryMagic[8] = {'L', 'U', 'N', 'G', 'T', 'E', 'L', 'E'};
+static constexpr uint32_t telemetryVersion = 1;
+static constexpr size_t telemetryColumnNameSize = 64;
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "The telemetry needs lock free atomics in the shared memory");
+
+// Removes the segment -name-, a publisher or reader that still maps it keeps
+// it until it is closed
+inline bool removeTelemetry(const std::string& name) { return shm_unlink(name.c_str()) == 0; }
+
+// This publishes the lung parameters and a few values per step into a
+// telemetry segment. The publisher never waits for a reader, a reader that
+// falls behind by more than -slotCount- records loses the oldest ones.
+class TelemetryPublisher {
+public:
+    ~TelemetryPublisher() { close(); };
+
+    bool isOpen() const { return header != nullptr; };
+    const std::string& getName() const { return name; };
+
+    // -name- is the name of the shared memory, e.g. "/lung", an old segment
+    // of the same name is replaced
+    bool open(const std::string& name, const std::vector<std::string>& columns, int slotCount, int rate, double dt) {
+        close();
+        if (slotCount < 1) slotCount = 1;
+        size_t columnOffset = (sizeof(TelemetryHeader) + 63) / 64 * 64;
+        size_t slotOffset = columnOffset + (columns.size() * telemetryColumnNameSize + 63) / 64 * 64;
+        size_t slotSize = (sizeof(TelemetrySlot) + columns.size() * sizeof(double) + 63) / 64 * 64;
+        size_t size = slotOffset + slotCount * slotSize;
+
+        // A reader that still maps the old segment keeps it, new readers see the new one
+        removeTelemetry(name);
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0 || ftruncate(fd, size) != 0) {
+            std::cout << "ERROR: Could not create the telemetry segment " << name << std::endl;
+            if (fd >= 0) { ::close(fd); removeTelemetry(name); }
+            return false;
+        }
+        mapped = (char*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            mapped = nullptr;
+            std::cout << "ERROR: Could not map the telemetry segment " << name << std::endl;
+            removeTelemetry(name);
+            return false;
+        }
+        mappedSize = size;
+        this->name = name;
+
+        // The segment is zeroed by ftruncate, so all sequences start at 0
+        header = new (mapped) TelemetryHeader();
+        header->version = telemetryVersion;
+        header->lungRecordSize = sizeof(LungParameters);
+        header->columnCount = columns.size();
+        header->slotCount = slotCount;
+        header->slotSize = slotSize;
+        header->slotOffset = slotOffset;
+        header->rate = rate;
+        header->pid = getpid();
+        header->dt = dt;
+        strncpy(header->lungSchema, LungParameters::schema, sizeof(header->lungSchema) - 1);
+        for (size_t c = 0; c < columns.size(); c++)
+            strncpy(mapped + columnOffset + c * telemetryColumnNameSize, columns[c].c_str(), telemetryColumnNameSize - 1);
+        for (int s = 0; s < slotCount; s++) new (mapped + slotOffset + s * slotSize) TelemetrySlot();
+        header->published.store(0, std::memory_order_relaxed);
+        header->finished.store(0, std::memory_order_relaxed);
+        // The magic comes last, a reader does not use a half written header
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header->magic, telemetryMagic, sizeof(header->magic));
+        return true;
+    };
+
+    // -values- has one value per column
+    inline void publish(int64_t step, const LungParameters& lungPrm, const double* values) {
+        uint64_t record = header->published.load(std::memory_order_relaxed);
+        char* slotData = mapped + header->slotOffset + (record % header->slotCount) * header->slotSize;
+        TelemetrySlot* slot = (TelemetrySlot*)slotData;
+
+        uint64_t sequence = slot->sequence.load(std::memory_order_relaxed);
+        slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot->step = step;
+        slot->lungPrm = lungPrm;
+        memcpy(slotData + sizeof(TelemetrySlot), values, header->columnCount * sizeof(double));
+        slot->sequence.store(sequence + 2, std::memory_order_release);
+        header->published.store(record + 1, std::memory_order_release);
+    };
+
+    // Marks the segment as finished, the last records stay readable until the
+    // segment is removed (see removeTelemetry())
+    void close() {
+        if (!mapped) return;
+        header->finished.store(1, std::memory_order_release);
+        munmap(mapped, mappedSize);
+        mapped = nullptr;
+        header = nullptr;
+        name.clear();
+    };
+
+private:
+    char* mapped = nullptr;
+    size_t mappedSize = 0;
+    TelemetryHeader* header = nullptr;
+    std::string name;
+};
+
+// One record of the telemetry
+struct TelemetryRecord {
+    int64_t step;
+    LungParameters lungPrm;
+    std::vector<double> values;
+};
+
+// This reads a telemetry segment while it is written, without ever holding up
+// the publisher. Records are read by their number, see read().
+class TelemetryReader {
+public:
+    ~TelemetryReader() { close(); };
+
+    bool open(const std::string& name) {
+        close();
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) return false;
+        struct stat info;
+        fstat(fd, &info);
+        if ((size_t)info.st_size >= sizeof(TelemetryHeader))
+            mapped = (char*)mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == nullptr || mapped == MAP_FAILED) {
+            mapped = nullptr;
+            return false;
+        }
+        mappedSize = info.st_size;
+
+        header = (const TelemetryHeader*)mapped;
+        if (memcmp(header->magic, telemetryMagic, sizeof(header->magic)) != 0) {
+            // The publisher has not finished the header yet
+            close();
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header->version != telemetryVersion || header->lungRecordSize != sizeof(LungParameters)
+            || strncmp(header->lungSchema, LungParameters::schema, sizeof(header->lungSchema)) != 0
+            || header->slotOffset + header->slotCount * header->slotSize > mappedSize) {
+            std::cout << "ERROR: " << name << " is not a telemetry segment of this model" << std::endl;
+            close();
+            return false;
+        }
+
+        size_t columnOffset = (sizeof(TelemetryHeader) + 63) / 64 * 64;
+        columns.clear();
+        for (size_t c = 0; c < header->columnCount; c++)
+            columns.push_back(std::string(mapped + columnOffset + c * telemetryColumnNameSize, strnlen(mapped + columnOffset + c * telemetryColumnNameSize, telemetryColumnNameSize)));
+        return true;
+    };
+
+    void close() {
+        if (mapped) munmap(mapped, mappedSize);
+        mapped = nullptr;
+        header = nullptr;
+        columns.clear();
+    };
+
+    bool isOpen() const { return header != nullptr; };
+    const std::vector<std::string>& getColumns() const { return columns; };
+    size_t getSlotCount() const { return header->slotCount; };
+    int getRate() const { return header->rate; };
+    int getPid() const { return header->pid; };
+    double getDt() const { return header->dt; };
+
+    // The number of records published so far
+    uint64_t getPublishedCount() const { return header->published.load(std::memory_order_acquire); };
+    bool isFinished() const { return header->finished.load(std::memory_order_acquire) != 0; };
+
+    // The first record that can still be read, the older ones are overwritten
+    uint64_t getOldestRecord() const {
+        uint64_t published = getPublishedCount();
+        return published > header->slotCount ? published - header->slotCount : 0;
+    };
+
+    // Copies record -k- into -record-. This fails if the record is not
+    // published yet or was already overwritten, it never blocks.
+    bool read(uint64_t k, TelemetryRecord& record) const {
+        const char* slotData = mapped + header->slotOffset + (k % header->slotCount) * header->slotSize;
+        const TelemetrySlot* slot = (const TelemetrySlot*)slotData;
+        uint64_t expected = 2 * (k / header->slotCount + 1);
+        record.values.resize(header->columnCount);
+        // The publisher only gets in the way if it laps the reader, so a few
+        // attempts are enough unless the record is gone for good
+        for (int attempt = 0; attempt < 4; attempt++) {
+            uint64_t before = slot->sequence.load(std::memory_order_acquire);
+            // Not published yet or overwritten
+            if (before + 1 < expected || before > expected) return false;
+            // Being written right now
+            if (before != expected) continue;
+            record.step = slot->step;
+            record.lungPrm = slot->lungPrm;
+            memcpy(record.values.data(), slotData + sizeof(TelemetrySlot), header->columnCount * sizeof(double));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot->sequence.load(std::memory_order_relaxed) == expected) return true;
+        }
+        return false;
+    };
+
+    // The newest record, false if there is none
+    bool readLatest(TelemetryRecord& record) const {
+        for (int attempt = 0; attempt < 4; attempt++) {
+            uint64_t published = getPublishedCount();
+            if (published == 0) return false;
+            if (read(published - 1, record)) return true;
+        }
+        return false;
+    };
+
+private:
+    char* mapped = nullptr;
+    size_t mappedSize = 0;
+    const TelemetryHeader* header = nullptr;
+    std::vector<std::string> columns;
+};
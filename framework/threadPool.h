@@ -0,0 +1,185 @@
+//
+//  threadPool.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 16.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LUNG_CPU_RELAX() _mm_pause()
+#else
+#define LUNG_CPU_RELAX() std::this_thread::yield()
+#endif
+
+// This is a long lived pool of worker threads owned by the lung. Spawning and
+// joining threads on every time step costs more than the branch update itself
+// for mid sized lungs, so the workers are created once and then wait for work.
+//
+// Work is handed out in chunks of -grain- indices. Every thread starts on its
+// own contiguous range of chunks and steals chunks from the other threads once
+// its own range is exhausted, so asymmetric branch updates are balanced out.
+// The calling thread always participates as thread 0.
+class ThreadPool {
+public:
+    ThreadPool(int threadCount = 1) { resize(threadCount); };
+    ~ThreadPool() { stop(); };
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return threadCount; };
+
+    // Stops the current workers and starts -threadCount- - 1 new ones. More
+    // threads than cores only make the spinning workers fight over the cores.
+    void resize(int threadCount) {
+        int cores = (int)std::thread::hardware_concurrency();
+        if (cores > 0 && threadCount > cores) threadCount = cores;
+        if (threadCount < 1) threadCount = 1;
+        if (threadCount == this->threadCount) return;
+        stop();
+
+        this->threadCount = threadCount;
+        cursors.reset(new Cursor[threadCount]);
+        stopping.store(false);
+        workers.reserve(threadCount - 1);
+        // The workers have to know the current epoch before they are started,
+        // otherwise a job published right away could go unnoticed
+        uint64_t seen = epoch.load();
+        for (int i = 1; i < threadCount; i++)
+            workers.emplace_back(&ThreadPool::workerLoop, this, i, seen);
+    };
+
+    // Calls f(begin, end, thread) for every chunk of [0, N) and returns once
+    // all chunks are done. This doubles as the barrier between two phases.
+    template <class F>
+    void parallelFor(size_t N, size_t grain, F&& f) {
+        if (N == 0) return;
+        if (grain == 0) grain = 1;
+        size_t chunks = (N + grain - 1) / grain;
+
+        // Not worth waking anybody up for this
+        if (threadCount == 1 || chunks == 1) {
+            for (size_t begin = 0; begin < N; begin += grain)
+                f(begin, std::min(begin + grain, N), 0);
+            return;
+        }
+
+        jobN = N;
+        jobGrain = grain;
+        jobContext = &f;
+        jobFunction = [](void* context, size_t begin, size_t end, int thread) {
+            (*static_cast<typename std::remove_reference<F>::type*>(context))(begin, end, thread);
+        };
+
+        for (int t = 0; t < threadCount; t++) {
+            cursors[t].next.store(chunks * t / threadCount, std::memory_order_relaxed);
+            cursors[t].end = chunks * (t + 1) / threadCount;
+        }
+        remaining.store(threadCount - 1, std::memory_order_relaxed);
+
+        // Publish the job and wake up the workers that went to sleep
+        epoch.fetch_add(1);
+        if (sleepers.load() > 0) {
+            { std::lock_guard<std::mutex> lock(sleepMutex); }
+            sleepCondition.notify_all();
+        }
+
+        runChunks(0);
+
+        // Wait for the stragglers, but give up the core if they take longer,
+        // they might be waiting for it
+        for (int i = 0; remaining.load(std::memory_order_acquire) != 0; i++) {
+            if (i < spinCount) LUNG_CPU_RELAX();
+            else std::this_thread::yield();
+        }
+    };
+
+private:
+    struct alignas(64) Cursor {
+        std::atomic<size_t> next{0};
+        size_t end = 0;
+    };
+
+    // A worker spins this many times for new work before it yields, and
+    // yields this many times before it goes to sleep. Between two time steps
+    // the workers should never reach the sleeping state.
+    static constexpr int spinCount = 1 << 12;
+    static constexpr int yieldCount = 1 << 10;
+
+    int threadCount = 0;
+    std::vector<std::thread> workers;
+    std::unique_ptr<Cursor[]> cursors;
+
+    void (*jobFunction)(void*, size_t, size_t, int) = nullptr;
+    void* jobContext = nullptr;
+    size_t jobN = 0;
+    size_t jobGrain = 1;
+
+    alignas(64) std::atomic<uint64_t> epoch{0};
+    alignas(64) std::atomic<int> remaining{0};
+    std::atomic<int> sleepers{0};
+    std::atomic<bool> stopping{false};
+    std::mutex sleepMutex;
+    std::condition_variable sleepCondition;
+
+    inline void runChunks(int thread) {
+        // First work through the own range of chunks, then steal from the others
+        for (int k = 0; k < threadCount; k++) {
+            Cursor& cursor = cursors[(thread + k) % threadCount];
+            for (size_t c = cursor.next.fetch_add(1, std::memory_order_relaxed); c < cursor.end; c = cursor.next.fetch_add(1, std::memory_order_relaxed))
+                jobFunction(jobContext, c * jobGrain, std::min((c + 1) * jobGrain, jobN), thread);
+        }
+    };
+
+    inline bool waitForWork(uint64_t seen) {
+        for (int i = 0; i < spinCount; i++) {
+            if (epoch.load(std::memory_order_acquire) != seen) return true;
+            if (stopping.load(std::memory_order_relaxed)) return false;
+            LUNG_CPU_RELAX();
+        }
+        for (int i = 0; i < yieldCount; i++) {
+            if (epoch.load(std::memory_order_acquire) != seen) return true;
+            if (stopping.load(std::memory_order_relaxed)) return false;
+            std::this_thread::yield();
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepers.fetch_add(1);
+        sleepCondition.wait(lock, [&] { return epoch.load() != seen || stopping.load(); });
+        sleepers.fetch_sub(1);
+        return !stopping.load();
+    };
+
+    void workerLoop(int thread, uint64_t seen) {
+        while (true) {
+            if (!waitForWork(seen) || stopping.load()) return;
+            seen = epoch.load(std::memory_order_acquire);
+            runChunks(thread);
+            remaining.fetch_sub(1, std::memory_order_release);
+        }
+    };
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping.store(true);
+        }
+        sleepCondition.notify_all();
+        for (auto& worker : workers) worker.join();
+        workers.clear();
+        threadCount = 0;
+    };
+};
@@ -0,0 +1,318 @@
+//
+//  branchArrays.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 16.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+#include "lung.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// This is a structure of arrays copy of the state of the binary tree branches.
+// The branch update of the binary tree model only needs a handful of values per
+// branch, so instead of walking over the full branch objects the update streams
+// through contiguous arrays and can be vectorized.
+//
+// The open state is double buffered: every step reads the state of the previous
+// step and writes the new one, so the branches can be updated in any order (and
+// on any number of threads) with the same results as the reverse serial loop.
+// The volumes are rounded like in BinaryTreeLungBranch::timeStep (see
+// multiplyAdd()), so the results are the same as with the branch objects, as
+// long as the code is compiled without -ffast-math.
+//
+// The arrays have the scalar type of the branch parameters (see LUNG_SCALAR),
+// with float a vector register holds twice as many branches.
+template <class Scalar>
+struct BinaryTreeBranchArraysT {
+    std::vector<Scalar> V;
+    std::vector<Scalar> V_max;
+    std::vector<Scalar> P_th;
+    // Prefactor of the volume change zeta * T^3 * R
+    std::vector<Scalar> k;
+    // Index of the parent branch, branches without a parent point to the
+    // always open sentinel at index N
+    std::vector<int32_t> parent;
+    // Open state of the previous and the current step. These carry the sentinel
+    // and some padding, so the vector gather can read 4 bytes at every index.
+    std::vector<uint8_t> isOpen;
+    std::vector<uint8_t> nextOpen;
+    // The multiplicity of every branch of a compressed lung, empty otherwise
+    // (see Lung::addCompressedBranches())
+    std::vector<uint64_t> multiplicity;
+    // The observables of the lung or nullptr, see Lung::addObservable()
+    LungObservables* observables = nullptr;
+
+    size_t size() const { return V.size(); };
+
+    // Copy the state of the branches into the arrays
+    template <class Branch>
+    void gather(std::vector<Branch>& branches, const std::vector<uint64_t>& multiplicity) {
+        this->multiplicity = multiplicity;
+        size_t N = branches.size();
+        V.resize(N); V_max.resize(N); P_th.resize(N); k.resize(N); parent.resize(N);
+        isOpen.assign(N + 4, 0);
+        nextOpen.assign(N + 4, 0);
+        isOpen[N] = nextOpen[N] = 1;
+
+        for (size_t i = 0; i < N; i++) {
+            BranchParameters* prm = branches[i]._getBranchParameters();
+            V[i] = prm->V;
+            V_max[i] = prm->V_max;
+            P_th[i] = prm->P_th;
+            k[i] = Scalar(branches[i]._getGlobalParameters()->zeta * pow(prm->T, 3) * prm->R);
+            isOpen[i] = prm->isOpen;
+
+            int connection = branches[i]._getConnectionIndex();
+            parent[i] = connection != BranchConnectivity::none ? int32_t(connection) : int32_t(N);
+        }
+    };
+
+    // Write the state of the arrays back into the branches
+    template <class Branch>
+    void scatter(std::vector<Branch>& branches) {
+        for (size_t i = 0; i < size(); i++) {
+            BranchParameters* prm = branches[i]._getBranchParameters();
+            prm->V = V[i];
+            prm->isOpen = isOpen[i];
+        }
+    };
+
+    // Sum of all branch volumes, exact like the sum over the branch objects
+    double volume() const {
+        ExactSum sum;
+        if (multiplicity.empty()) for (size_t i = 0; i < size(); i++) sum.add(V[i]);
+        else for (size_t i = 0; i < size(); i++) sum.add(V[i], multiplicity[i]);
+        return sum.get();
+    };
+
+    // -open- is the new open state of branch i, -thread- the thread of the
+    // update. Only closed branches are updated, so an open one just opened,
+    // maybe without changing its volume (at V_max already).
+    inline void addVolumeChange(ExactSum& volumeChange, size_t i, double dV, bool open, int thread) const {
+        if (multiplicity.empty()) volumeChange.add(dV);
+        else volumeChange.add(dV, multiplicity[i]);
+        if (observables && (dV != 0 || open))
+            observables->observe(thread, int(i), dV, BranchState{V[i], open}, multiplicity.empty() ? 1 : multiplicity[i]);
+    };
+
+    // This is the binary tree branch time step for the branches [begin, end).
+    // -dP- is the pressure difference P - P_ip of the lung. The volume changes
+    // of the branches are added to -volumeChange-, -thread- is the thread that
+    // runs this part of the update.
+    // The volume changes are taken in double, like the branches do it.
+    // Returns the number of branches that opened.
+    inline size_t timeStep(size_t begin, size_t end, double dP, double dt, ExactSum& volumeChange, int thread = 0) {
+        size_t i = begin;
+        size_t openedCount = 0;
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+        if constexpr (std::is_same_v<Scalar, float>) i = timeStepAVX512Float(i, end, dP, dt, volumeChange, openedCount, thread);
+        else i = timeStepAVX512(i, end, dP, dt, volumeChange, openedCount, thread);
+#elif defined(__AVX2__)
+        if constexpr (std::is_same_v<Scalar, float>) i = timeStepAVX2Float(i, end, dP, dt, volumeChange, openedCount, thread);
+        else i = timeStepAVX2(i, end, dP, dt, volumeChange, openedCount, thread);
+#endif
+        const Scalar dP_s = Scalar(dP), dt_s = Scalar(dt);
+        for (; i < end; i++) {
+            uint8_t open = isOpen[i];
+            if (isOpen[parent[i]] && !open) {
+                double oldV = V[i];
+                Scalar d = dP_s - P_th[i];
+                if (d > 0) V[i] = multiplyAdd(k[i] * d, dt_s, V[i]);
+                if (V[i] > V_max[i]) {
+                    V[i] = V_max[i];
+                    open = 1;
+                    openedCount++;
+                }
+                addVolumeChange(volumeChange, i, V[i] - oldV, open, thread);
+            }
+            nextOpen[i] = open;
+        }
+        return openedCount;
+    };
+
+    // Has to be called once after all branches have been updated
+    inline void finishTimeStep() { isOpen.swap(nextOpen); };
+
+private:
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+    inline size_t timeStepAVX512(size_t i, size_t end, double dP, double dt, ExactSum& volumeChange, size_t& openedCount, int thread) {
+        const __m512d vdP = _mm512_set1_pd(dP);
+        const __m512d vdt = _mm512_set1_pd(dt);
+        const __m512d zero = _mm512_setzero_pd();
+        for (; i + 8 <= end; i += 8) {
+            // Gather the open state of the parents, 4 bytes at a time
+            __m256i idx = _mm256_loadu_si256((const __m256i*)(parent.data() + i));
+            __m256i parentOpen = _mm256_i32gather_epi32((const int*)isOpen.data(), idx, 1);
+            parentOpen = _mm256_and_si256(parentOpen, _mm256_set1_epi32(0xFF));
+            __m256i open = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(isOpen.data() + i)));
+            __mmask8 active = _mm256_cmpneq_epi32_mask(parentOpen, _mm256_setzero_si256())
+                            & _mm256_cmpeq_epi32_mask(open, _mm256_setzero_si256());
+
+            __m512d oldV = _mm512_loadu_pd(V.data() + i);
+            __m512d V_i = oldV;
+            __m512d d = _mm512_sub_pd(vdP, _mm512_loadu_pd(P_th.data() + i));
+            __mmask8 grow = active & _mm512_cmp_pd_mask(d, zero, _CMP_GT_OQ);
+            // V + k * d * dt with a fused multiply add, like multiplyAdd()
+            V_i = _mm512_mask3_fmadd_pd(_mm512_mul_pd(_mm512_loadu_pd(k.data() + i), d), vdt, V_i, grow);
+
+            __m512d V_max_i = _mm512_loadu_pd(V_max.data() + i);
+            __mmask8 opened = active & _mm512_cmp_pd_mask(V_i, V_max_i, _CMP_GT_OQ);
+            V_i = _mm512_mask_mov_pd(V_i, opened, V_max_i);
+            _mm512_storeu_pd(V.data() + i, V_i);
+
+            // Only few branches change at once, those are summed up one by one
+            if (grow | opened) {
+                openedCount += __builtin_popcount(opened);
+                alignas(64) double dV_i[8];
+                _mm512_store_pd(dV_i, _mm512_sub_pd(V_i, oldV));
+                for (int j = 0; j < 8; j++) if (active & (1 << j)) addVolumeChange(volumeChange, i + j, dV_i[j], (opened >> j) & 1, thread);
+            }
+
+            open = _mm256_mask_mov_epi32(open, opened, _mm256_set1_epi32(1));
+            _mm_storel_epi64((__m128i*)(nextOpen.data() + i), _mm256_cvtepi32_epi8(open));
+        }
+        return i;
+    };
+
+    // Same as above with 16 floats per register
+    inline size_t timeStepAVX512Float(size_t i, size_t end, double dP, double dt, ExactSum& volumeChange, size_t& openedCount, int thread) {
+        const __m512 vdP = _mm512_set1_ps(float(dP));
+        const __m512 vdt = _mm512_set1_ps(float(dt));
+        const __m512 zero = _mm512_setzero_ps();
+        for (; i + 16 <= end; i += 16) {
+            // Gather the open state of the parents, 4 bytes at a time
+            __m512i idx = _mm512_loadu_si512((const void*)(parent.data() + i));
+            __m512i parentOpen = _mm512_i32gather_epi32(idx, (const int*)isOpen.data(), 1);
+            parentOpen = _mm512_and_si512(parentOpen, _mm512_set1_epi32(0xFF));
+            __m512i open = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(isOpen.data() + i)));
+            __mmask16 active = _mm512_cmpneq_epi32_mask(parentOpen, _mm512_setzero_si512())
+                             & _mm512_cmpeq_epi32_mask(open, _mm512_setzero_si512());
+
+            __m512 oldV = _mm512_loadu_ps(V.data() + i);
+            __m512 V_i = oldV;
+            __m512 d = _mm512_sub_ps(vdP, _mm512_loadu_ps(P_th.data() + i));
+            __mmask16 grow = active & _mm512_cmp_ps_mask(d, zero, _CMP_GT_OQ);
+            V_i = _mm512_mask3_fmadd_ps(_mm512_mul_ps(_mm512_loadu_ps(k.data() + i), d), vdt, V_i, grow);
+
+            __m512 V_max_i = _mm512_loadu_ps(V_max.data() + i);
+            __mmask16 opened = active & _mm512_cmp_ps_mask(V_i, V_max_i, _CMP_GT_OQ);
+            V_i = _mm512_mask_mov_ps(V_i, opened, V_max_i);
+            _mm512_storeu_ps(V.data() + i, V_i);
+
+            // Only few branches change at once, those are summed up one by one
+            if (grow | opened) {
+                openedCount += __builtin_popcount(opened);
+                alignas(64) float oldV_i[16], newV_i[16];
+                _mm512_store_ps(oldV_i, oldV);
+                _mm512_store_ps(newV_i, V_i);
+                for (int j = 0; j < 16; j++) if (active & (1 << j)) addVolumeChange(volumeChange, i + j, double(newV_i[j]) - oldV_i[j], (opened >> j) & 1, thread);
+            }
+
+            open = _mm512_mask_mov_epi32(open, opened, _mm512_set1_epi32(1));
+            _mm_storeu_si128((__m128i*)(nextOpen.data() + i), _mm512_cvtepi32_epi8(open));
+        }
+        return i;
+    };
+#elif defined(__AVX2__)
+    inline size_t timeStepAVX2(size_t i, size_t end, double dP, double dt, ExactSum& volumeChange, size_t& openedCount, int thread) {
+        const __m256d vdP = _mm256_set1_pd(dP);
+        const __m256d vdt = _mm256_set1_pd(dt);
+        const __m256d zero = _mm256_setzero_pd();
+        for (; i + 4 <= end; i += 4) {
+            // Gather the open state of the parents, 4 bytes at a time
+            __m128i idx = _mm_loadu_si128((const __m128i*)(parent.data() + i));
+            __m128i parentOpen = _mm_and_si128(_mm_i32gather_epi32((const int*)isOpen.data(), idx, 1), _mm_set1_epi32(0xFF));
+            int32_t ownBytes;
+            memcpy(&ownBytes, isOpen.data() + i, 4);
+            __m128i open = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(ownBytes));
+            __m128i active32 = _mm_andnot_si128(_mm_cmpeq_epi32(parentOpen, _mm_setzero_si128()), _mm_cmpeq_epi32(open, _mm_setzero_si128()));
+            __m256d active = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(active32));
+
+            __m256d oldV = _mm256_loadu_pd(V.data() + i);
+            __m256d V_i = oldV;
+            __m256d d = _mm256_sub_pd(vdP, _mm256_loadu_pd(P_th.data() + i));
+            __m256d grow = _mm256_and_pd(active, _mm256_cmp_pd(d, zero, _CMP_GT_OQ));
+            // V + k * d * dt, rounded like multiplyAdd()
+            __m256d kd = _mm256_mul_pd(_mm256_loadu_pd(k.data() + i), d);
+#ifdef LUNG_HAS_FMA
+            V_i = _mm256_blendv_pd(V_i, _mm256_fmadd_pd(kd, vdt, V_i), grow);
+#else
+            V_i = _mm256_blendv_pd(V_i, _mm256_add_pd(V_i, _mm256_mul_pd(kd, vdt)), grow);
+#endif
+
+            __m256d V_max_i = _mm256_loadu_pd(V_max.data() + i);
+            __m256d opened = _mm256_and_pd(active, _mm256_cmp_pd(V_i, V_max_i, _CMP_GT_OQ));
+            V_i = _mm256_blendv_pd(V_i, V_max_i, opened);
+            _mm256_storeu_pd(V.data() + i, V_i);
+
+            int mask = _mm256_movemask_pd(opened);
+            openedCount += __builtin_popcount(mask);
+            for (int j = 0; j < 4; j++) nextOpen[i + j] = isOpen[i + j] | ((mask >> j) & 1);
+
+            // Only few branches change at once, those are summed up one by one
+            int changed = _mm256_movemask_pd(active);
+            if (_mm256_movemask_pd(_mm256_or_pd(grow, opened))) {
+                alignas(32) double dV_i[4];
+                _mm256_store_pd(dV_i, _mm256_sub_pd(V_i, oldV));
+                for (int j = 0; j < 4; j++) if (changed & (1 << j)) addVolumeChange(volumeChange, i + j, dV_i[j], (mask >> j) & 1, thread);
+            }
+        }
+        return i;
+    };
+
+    // Same as above with 8 floats per register
+    inline size_t timeStepAVX2Float(size_t i, size_t end, double dP, double dt, ExactSum& volumeChange, size_t& openedCount, int thread) {
+        const __m256 vdP = _mm256_set1_ps(float(dP));
+        const __m256 vdt = _mm256_set1_ps(float(dt));
+        const __m256 zero = _mm256_setzero_ps();
+        for (; i + 8 <= end; i += 8) {
+            // Gather the open state of the parents, 4 bytes at a time
+            __m256i idx = _mm256_loadu_si256((const __m256i*)(parent.data() + i));
+            __m256i parentOpen = _mm256_and_si256(_mm256_i32gather_epi32((const int*)isOpen.data(), idx, 1), _mm256_set1_epi32(0xFF));
+            __m256i open = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(isOpen.data() + i)));
+            __m256 active = _mm256_castsi256_ps(_mm256_andnot_si256(_mm256_cmpeq_epi32(parentOpen, _mm256_setzero_si256()), _mm256_cmpeq_epi32(open, _mm256_setzero_si256())));
+
+            __m256 oldV = _mm256_loadu_ps(V.data() + i);
+            __m256 V_i = oldV;
+            __m256 d = _mm256_sub_ps(vdP, _mm256_loadu_ps(P_th.data() + i));
+            __m256 grow = _mm256_and_ps(active, _mm256_cmp_ps(d, zero, _CMP_GT_OQ));
+            __m256 kd = _mm256_mul_ps(_mm256_loadu_ps(k.data() + i), d);
+#ifdef LUNG_HAS_FMA
+            V_i = _mm256_blendv_ps(V_i, _mm256_fmadd_ps(kd, vdt, V_i), grow);
+#else
+            V_i = _mm256_blendv_ps(V_i, _mm256_add_ps(V_i, _mm256_mul_ps(kd, vdt)), grow);
+#endif
+
+            __m256 V_max_i = _mm256_loadu_ps(V_max.data() + i);
+            __m256 opened = _mm256_and_ps(active, _mm256_cmp_ps(V_i, V_max_i, _CMP_GT_OQ));
+            V_i = _mm256_blendv_ps(V_i, V_max_i, opened);
+            _mm256_storeu_ps(V.data() + i, V_i);
+
+            int mask = _mm256_movemask_ps(opened);
+            openedCount += __builtin_popcount(mask);
+            for (int j = 0; j < 8; j++) nextOpen[i + j] = isOpen[i + j] | ((mask >> j) & 1);
+
+            // Only few branches change at once, those are summed up one by one
+            int changed = _mm256_movemask_ps(active);
+            if (_mm256_movemask_ps(_mm256_or_ps(grow, opened))) {
+                alignas(32) float oldV_i[8], newV_i[8];
+                _mm256_store_ps(oldV_i, oldV);
+                _mm256_store_ps(newV_i, V_i);
+                for (int j = 0; j < 8; j++) if (changed & (1 << j)) addVolumeChange(volumeChange, i + j, double(newV_i[j]) - oldV_i[j], (mask >> j) & 1, thread);
+            }
+        }
+        return i;
+    };
+#endif
+};
+
+typedef BinaryTreeBranchArraysT<BranchParameters::scalar_type> BinaryTreeBranchArrays;
@@ -11,13 +11,13 @@
 
 // The base class is a templated class and takes this class as a template argument,
 // the inheritance will always look like this
-class BinaryTreeLungBranch : public LungBranch<BinaryTreeLungBranch> {
+class BinaryTreeLungBranch final : public LungBranch<BinaryTreeLungBranch> {
     // Define the super type to easily access the base class
     typedef LungBranch<BinaryTreeLungBranch> super;
 
     // Use for additional setup of the branch at creation. The init() of the base class will call the init() of the branchParameter struct.
     // This is optional
-    void init() override { }
+    void init() { }
 
 public:
     // This is the initializer it will call the initializer of the base class
@@ -26,17 +26,30 @@ public:
         init();
     };
 
-    // This is the "local" time step for each of the branches
-    inline void timeStep(ExternalParameters* _extern_params, LungParameters* _lung_params, TimeStepParameters* q) override
+    // A branch can only change while it is closed and its parent is open, once
+    // it is open it stays like that
+    inline bool isActive()
+    {
+        BinaryTreeLungBranch* parent = _getConnection();
+        return (parent == nullptr || parent->_getBranchParameters()->isOpen) && !prm.isOpen;
+    }
+
+    // This is the "local" time step for each of the branches, it returns the
+    // change of the branch volume, which the lung sums up over all branches
+    inline double timeStep(ExternalParameters* _extern_params, LungParameters* _lung_params, TimeStepParameters* q)
     {
         // Realization of the simple binary tree model on the branch level
-        if ((_connections.size() == 0 || _connections[0]->_getBranchParameters()->isOpen) && !prm.isOpen)
+        if (isActive())
         {
+            double oldV = prm.V;
+
             // If the pressure difference is bigger than the pressure threshold
             // we change the volume based on the biomechanical equation that we came up with
-
-            if (_lung_params->P - (_lung_params->P_ip) - prm.P_th > 0)
-                prm.V += _prm_global->zeta * pow(prm.T,3) * prm.R * (_lung_params->P - (_lung_params->P_ip) - prm.P_th) * _extern_params->dt;
+            // The update is done in the scalar type of the branch parameters, see LUNG_SCALAR
+            typedef BranchParameters::scalar_type Scalar;
+            Scalar difference = Scalar(_lung_params->P - (_lung_params->P_ip)) - prm.P_th;
+            if (difference > 0)
+                prm.V = multiplyAdd(Scalar(_prm_global->zeta * pow(prm.T,3) * prm.R) * difference, Scalar(_extern_params->dt), prm.V);
 
             // This makes sure that the volume of a branch always stays inside
             // of the volume bounds
@@ -45,6 +58,8 @@ public:
                 prm.V = prm.V_max;
                 prm.isOpen = true;
             }
+            return prm.V - oldV;
         }
+        return 0;
     }
 };
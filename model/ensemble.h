@@ -0,0 +1,223 @@
+//
+//  ensemble.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 16.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "lung.h"
+#include "lungScaleModel.h"
+
+// This runs many binary tree lungs with the same tree structure at once, e.g.
+// for parameter studies over zeta, the threshold pressures or the V_ip
+// schedule. The tree is stored once and the state of all members is kept in
+// arrays with the members next to each other: the value of member m at branch
+// i is at [i * stride + m]. The branch update then runs over blocks of
+// -blockSize- members with the same instructions, which the compiler
+// vectorizes, and the blocks are spread over the threads of the pool.
+//
+// Every member does exactly the same arithmetic as a BinaryTreeLung with the
+// same parameters, so the results are identical to running the lungs one by one.
+class BinaryTreeEnsemble {
+    // The state of the branches has the scalar type of the branch parameters
+    typedef BranchParameters::scalar_type Scalar;
+
+public:
+    // The open states of a block are handled as one 64 bit word
+    static constexpr int blockSize = 8;
+
+    // The structure, the branch parameters and the current state of -lung- are
+    // copied into every one of the -memberCount- members
+    template <class Policy>
+    BinaryTreeEnsemble(BinaryTreeLungModel<Policy>& lung, int memberCount) {
+        lung.synchronizeBranches();
+        lung.compactBranches();
+        externPrm = *lung._getExternParams();
+        members = memberCount > 0 ? memberCount : 1;
+        // The padding members are copies of the first member, they are updated
+        // with the others but never read
+        stride = (members + blockSize - 1) / blockSize * blockSize;
+        N = lung.getBranchCount();
+
+        parent.resize(N);
+        V_max.resize(N);
+        T3.resize(N);
+        R.resize(N);
+        if (lung.isCompressed()) multiplicity.resize(N);
+        V.resize(N * stride);
+        P_th.resize(N * stride);
+        isOpen.assign((N + 1) * stride, 0);
+        nextOpen.assign((N + 1) * stride, 0);
+        // Branches without a parent point to the always open sentinel row N
+        for (size_t m = 0; m < stride; m++) isOpen[N * stride + m] = nextOpen[N * stride + m] = 1;
+
+        for (size_t i = 0; i < N; i++) {
+            BinaryTreeLungBranch* branch = lung._getBranch(int(i));
+            BranchParameters* prm = branch->_getBranchParameters();
+            int connection = branch->_getConnectionIndex();
+            parent[i] = connection != BranchConnectivity::none ? int32_t(connection) : int32_t(N);
+            V_max[i] = prm->V_max;
+            T3[i] = pow(prm->T, 3);
+            R[i] = prm->R;
+            if (!multiplicity.empty()) multiplicity[i] = lung.getMultiplicity(int(i));
+            for (size_t m = 0; m < stride; m++) {
+                V[i * stride + m] = prm->V;
+                P_th[i * stride + m] = prm->P_th;
+                isOpen[i * stride + m] = prm->isOpen;
+            }
+        }
+
+        double zeta0 = N > 0 ? lung._getBranch(0)->_getGlobalParameters()->zeta : 0;
+        zeta.assign(stride, zeta0);
+        lungPrm.assign(stride, *lung._getLungParams());
+        threadSums.resize(stride);
+    };
+
+    int size() const { return members; };
+    int getBranchCount() const { return int(N); };
+
+    LungParameters* _getLungParams(int member) { return &lungPrm[member]; };
+    double _getVolume(int member, int branch) { return V[branch * stride + member]; };
+    bool _isOpen(int member, int branch) { return isOpen[branch * stride + member]; };
+
+    // Per member parameters, these have to be set before the first time step
+    void setZeta(int member, double value) { zeta[member] = value; };
+    void setThresholdPressure(int member, int branch, double value) { P_th[branch * stride + member] = value; };
+    // -values- holds the threshold pressure of every branch in branch order
+    void setThresholdPressures(int member, const double* values) {
+        for (size_t i = 0; i < N; i++) P_th[i * stride + member] = values[i];
+    };
+
+    // The members are handed to the threads in blocks, -grain- is the number
+    // of members a thread takes at once
+    void useThreading(int threadCount = 4, int grain = 64) {
+        threadPool.resize(threadCount);
+        this->grain = grain;
+    };
+
+    // Record the lung parameters of all members every -trackingRate- steps
+    void trackHistory(int trackingRate = 1) { historyTrackingRate = trackingRate; };
+    // The history of all members, record r of member m is at [r * size() + m]
+    std::vector<LungParameters>* _getHistory() { return &history; };
+
+    // This advances all members by one step, -V_ip- holds the intrapleural
+    // volume of every member
+    void timeStep(const double* V_ip) {
+        size_t blocks = stride / blockSize;
+        size_t blockGrain = std::max<size_t>(1, grain / blockSize);
+        threadPool.parallelFor(blocks, blockGrain, [&](size_t first, size_t last, int) {
+            for (size_t b = first; b < last; b++) timeStepBlock(b * blockSize, V_ip);
+        });
+        isOpen.swap(nextOpen);
+
+        timeSteps++;
+        if (historyTrackingRate > 0 && timeSteps % historyTrackingRate == 0)
+            history.insert(history.end(), lungPrm.begin(), lungPrm.begin() + members);
+    };
+
+    // Same as above, with the time step parameters of every member
+    void timeStep(const TimeStepParameters* q) {
+        V_ipBuffer.resize(members);
+        for (int m = 0; m < members; m++) V_ipBuffer[m] = q[m].V_ip;
+        timeStep(V_ipBuffer.data());
+    };
+
+private:
+    ExternalParameters externPrm;
+    int members = 0;
+    size_t stride = 0;
+    size_t N = 0;
+
+    // Shared by all members
+    std::vector<int32_t> parent;
+    std::vector<Scalar> V_max;
+    std::vector<double> T3;
+    std::vector<double> R;
+    // Only for a compressed lung, see Lung::addCompressedBranches()
+    std::vector<uint64_t> multiplicity;
+
+    // Per branch and member, see the layout above
+    std::vector<Scalar> V;
+    std::vector<Scalar> P_th;
+    std::vector<uint8_t> isOpen;
+    std::vector<uint8_t> nextOpen;
+
+    // Per member
+    std::vector<double> zeta;
+    std::vector<LungParameters> lungPrm;
+    std::vector<ExactSum> threadSums;
+    std::vector<double> V_ipBuffer;
+
+    ThreadPool threadPool;
+    int grain = 64;
+    int timeSteps = 0;
+    int historyTrackingRate = 0;
+    std::vector<LungParameters> history;
+
+    // BinaryTreeLung::timeStep for the members [m0, m0 + blockSize)
+    inline void timeStepBlock(size_t m0, const double* V_ip) {
+        double dP[blockSize];
+        double oldV[blockSize];
+        ExactSum* volumeChange = threadSums.data() + m0;
+        for (int j = 0; j < blockSize; j++) {
+            LungParameters& prm = lungPrm[m0 + j];
+            double oldV_ip = prm.V_ip;
+            prm.V_ip = V_ip[m0 + j < (size_t)members ? m0 + j : 0];
+            prm.P_ip = (prm.P_ip + 1) * oldV_ip / prm.V_ip - 1.;
+            oldV[j] = prm.V;
+            dP[j] = prm.P - prm.P_ip;
+            volumeChange[j] = ExactSum();
+        }
+
+        const double dt = externPrm.dt;
+        const double* zeta_m = zeta.data() + m0;
+        for (size_t i = 0; i < N; i++) {
+            Scalar* V_i = V.data() + i * stride + m0;
+            const Scalar* P_th_i = P_th.data() + i * stride + m0;
+            const uint8_t* open = isOpen.data() + i * stride + m0;
+            const uint8_t* parentOpen = isOpen.data() + parent[i] * stride + m0;
+            uint8_t* nextOpen_i = nextOpen.data() + i * stride + m0;
+            const Scalar V_max_i = V_max[i];
+            const double T3_i = T3[i], R_i = R[i];
+
+            // Most branches are inactive for all members of the block (closed
+            // parent or already open), those only carry their open state over
+            uint64_t parentBytes, openBytes;
+            memcpy(&parentBytes, parentOpen, blockSize);
+            memcpy(&openBytes, open, blockSize);
+            memcpy(nextOpen_i, open, blockSize);
+            if ((parentBytes & ~openBytes) == 0) continue;
+
+            // Same operations as BinaryTreeLungBranch::timeStep, without branches
+            double dV[blockSize];
+            for (int j = 0; j < blockSize; j++) {
+                bool active = parentOpen[j] && !open[j];
+                Scalar v = V_i[j];
+                Scalar d = Scalar(dP[j]) - P_th_i[j];
+                Scalar grown = d > 0 ? multiplyAdd(Scalar(zeta_m[j] * T3_i * R_i) * d, Scalar(dt), v) : v;
+                bool opened = active && grown > V_max_i;
+                Scalar next = opened ? V_max_i : (active ? grown : v);
+                nextOpen_i[j] = open[j] | opened;
+                dV[j] = double(next) - v;
+                V_i[j] = next;
+            }
+            if (multiplicity.empty()) for (int j = 0; j < blockSize; j++) volumeChange[j].add(dV[j]);
+            else for (int j = 0; j < blockSize; j++) volumeChange[j].add(dV[j], multiplicity[i]);
+        }
+
+        for (int j = 0; j < blockSize; j++) {
+            LungParameters& prm = lungPrm[m0 + j];
+            prm.V += volumeChange[j].get();
+            prm.P = (prm.P + 1) * oldV[j] / prm.V - 1.;
+            double omega = externPrm.Omega + dt / prm.V;
+            prm.q = - (prm.P)/omega;
+            prm.dP = prm.P;
+            prm.P += prm.q*dt / prm.V;
+        }
+    };
+};
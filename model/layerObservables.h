@@ -0,0 +1,133 @@
+//
+//  layerObservables.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 17.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+#include <iostream>
+#include <string>
+#include <vector>
+#include "lung.h"
+
+// This is the base of the observables of the binary tree model that sum up a
+// value per layer_ID. -Derived- implements
+//   double initialValue(const BranchParameters&)   the value of a branch at the reset
+//   double change(double dV, const BranchState&)   the change of the value of a changed branch
+// The sums are exact (see ExactSum), so they do not depend on the number of
+// threads or the update routine. A branch of a compressed lung counts for
+// every branch it stands for.
+template <class Derived>
+class LayerObservable : public Observable {
+public:
+    std::vector<std::string> columns() override {
+        std::vector<std::string> names;
+        for (int l = 0; l < layerCount; l++) names.push_back("layer" + std::to_string(l));
+        return names;
+    };
+
+    void reset(const ObservedBranches& branches, int threads) override {
+        layerOf.resize(branches.count);
+        int maxLayer = -1;
+        for (size_t i = 0; i < branches.count; i++) {
+            layerOf[i] = branches.branchAt(i).layer_ID;
+            maxLayer = std::max<int>(maxLayer, layerOf[i]);
+        }
+        // The layers are fixed with the first reset, so the columns stay the same
+        if (layerCount < 0) layerCount = maxLayer + 1;
+        else if (maxLayer >= layerCount)
+            std::cout << "WARNING: " << name() << " only observes the layers it was started with" << std::endl;
+
+        totals.assign(layerCount, ExactSum());
+        branchCounts.assign(layerCount, 0);
+        for (size_t i = 0; i < branches.count; i++) {
+            int layer = layerOf[i];
+            if (layer < 0 || layer >= layerCount) continue;
+            uint64_t multiplicity = branches.multiplicityAt(i);
+            totals[layer].add(static_cast<Derived*>(this)->initialValue(branches.branchAt(i)), multiplicity);
+            branchCounts[layer] += multiplicity;
+        }
+        accumulators.assign(threads, ThreadAccumulator());
+        for (auto& accumulator : accumulators) accumulator.sums.assign(layerCount, ExactSum());
+        static_cast<Derived*>(this)->resetStep();
+    };
+
+    void observe(int thread, int branch, double dV, const BranchState& state, uint64_t multiplicity) override {
+        int layer = layerOf[branch];
+        if (layer < 0 || layer >= layerCount) return;
+        accumulators[thread].sums[layer].add(static_cast<Derived*>(this)->change(dV, state), multiplicity);
+    };
+
+    void endStep() override {
+        static_cast<Derived*>(this)->resetStep();
+        for (auto& accumulator : accumulators) {
+            for (int l = 0; l < layerCount; l++) {
+                static_cast<Derived*>(this)->mergeStep(l, accumulator.sums[l]);
+                accumulator.sums[l] = ExactSum();
+            }
+        }
+    };
+
+protected:
+    int layerCount = -1;
+    // The layer of every branch
+    std::vector<short> layerOf;
+    // The sum of the values and the number of branches of every layer
+    std::vector<ExactSum> totals;
+    std::vector<uint64_t> branchCounts;
+
+    // Models of a value that is summed up over all steps, Derived can hide these
+    void resetStep() {};
+    void mergeStep(int layer, const ExactSum& change) { totals[layer].add(change); };
+
+private:
+    // The changes of the current step, one per thread and layer
+    struct alignas(64) ThreadAccumulator { std::vector<ExactSum> sums; };
+    std::vector<ThreadAccumulator> accumulators;
+};
+
+// The volume of every layer
+class LayerVolume final : public LayerObservable<LayerVolume> {
+public:
+    std::string name() override { return "V"; };
+    double initialValue(const BranchParameters& prm) { return prm.V; };
+    double change(double dV, const BranchState&) { return dV; };
+
+    void sample(double* values) override {
+        for (int l = 0; l < layerCount; l++) values[l] = totals[l].get();
+    };
+};
+
+// The fraction of the branches of every layer that is open. A branch of the
+// binary tree model only changes while it is closed, so a changed branch
+// that is open now has just opened.
+class LayerOpenFraction final : public LayerObservable<LayerOpenFraction> {
+public:
+    std::string name() override { return "openFraction"; };
+    double initialValue(const BranchParameters& prm) { return prm.isOpen; };
+    double change(double, const BranchState& state) { return state.isOpen; };
+
+    void sample(double* values) override {
+        for (int l = 0; l < layerCount; l++) values[l] = branchCounts[l] ? totals[l].get() / branchCounts[l] : 0;
+    };
+};
+
+// The number of branches of every layer that opened in the last step
+class LayerOpenings final : public LayerObservable<LayerOpenings> {
+public:
+    std::string name() override { return "openings"; };
+    double initialValue(const BranchParameters&) { return 0; };
+    double change(double, const BranchState& state) { return state.isOpen; };
+
+    void resetStep() { steps.assign(layerCount, ExactSum()); };
+    void mergeStep(int layer, const ExactSum& change) { steps[layer].add(change); };
+
+    void sample(double* values) override {
+        for (int l = 0; l < layerCount; l++) values[l] = steps[l].get();
+    };
+
+private:
+    std::vector<ExactSum> steps;
+};
@@ -7,55 +7,97 @@
 //
 
 #pragma once
+#include <type_traits>
 #include "lung.h"
+#include "branchArrays.h"
 
-// The base class is a templated class and takes the Branch class as a template argument
-class BinaryTreeLung : public Lung<BinaryTreeLungBranch> {
+// The base class is a templated class and takes the Branch class as a template argument.
+// The -Policy- turns features of the lung on and off at compile time, see LungPolicy,
+// BinaryTreeLung below is the model with all of them.
+template <class Policy = LungPolicy<>>
+class BinaryTreeLungModel final : public Lung<BinaryTreeLungBranch, Policy> {
 private:
-    typedef Lung<BinaryTreeLungBranch> super;
+    typedef Lung<BinaryTreeLungBranch, Policy> super;
 
-    // This is an override to the vitual member function init() of the base class, the base classes init() will still be called
-    // and it will take care of all the memory management. So this is purely for further, model specific, setup.
+    // The members of the base class depend on the template argument, so they
+    // have to be named here to be found
+    using super::lungPrm;
+    using super::externPrm;
+    using super::functionalPrm;
+    using super::branches;
+    using super::multiplicity;
+    using super::frontier;
+    using super::frontierVersion;
+    using super::topologyVersion;
+    using super::threadPool;
+    using super::threadSums;
+    using super::profiler;
+    using super::observables;
+    using super::prepareObservables;
+    using super::endObservedStep;
+    using super::buildFrontier;
+    using super::updateFrontier;
+    using super::triggerHistoryEvent;
+    using super::recordHistoryEvent;
+    using super::updateBranches;
+    using super::updateBranch;
+    using super::levelSynchronousUpdateBranches;
+    using super::frontierUpdateBranches;
+
+    // This hides the init() of the base class, the base classes init() is still called by its
+    // constructor and it will take care of all the memory management. So this is purely for further, model specific, setup.
     // Here we set our initial conditions for the simulation
-    void init() override {
+    void init() {
         lungPrm.P = externPrm.P_init;
         lungPrm.P_ip = externPrm.P_ip_init;
         lungPrm.V_ip = externPrm.V_ip_init;
     }
 
-    void updateVolume() {
-        // This updates the volume of the lung by adding up all the volumes of the branches
-        lungPrm.V = 0;
-        for (int i = 0; i < branches.size(); i++) lungPrm.V += branches[i]._getBranchParameters()->V;
-    }
+    // The structure of arrays backend, see useStructureOfArrays()
+    bool useArrays = false;
+    BinaryTreeBranchArrays branchArrays;
+    unsigned long branchArraysVersion = -1;
 
-public:
-    // These are the initializers they will call the initializer of the base class
-    BinaryTreeLung(GlobalBranchParameters branch_prm, ExternalParameters extern_prm) : super(branch_prm, extern_prm) { init(); };
-    BinaryTreeLung(ExternalParameters extern_prm) : super(extern_prm) { init(); };
+    // See checkVolumeDrift()
+    int volumeCheckRate = 0;
+    double volumeDrift = 0;
 
-    // This is the "global" time step for the lung
-    // Realization of the simple binary tree model on the lung level
-    inline void timeStep(TimeStepParameters* q) override
-    {
-        // Volume increase in the thoraxic cavity
+    // The smallest threshold pressure on the frontier and what the last macro
+    // step found out about the frontier, see advance(). The growth rates are
+    // the sums of zeta * T^3 * R (times the multiplicity) of the growing and
+    // of the waiting branches.
+    double frontierThreshold = INFINITY;
+    double stepsToOpen = 0;
+    double smallestGrowingDifference = 0;
+    double smallestWaitingThreshold = 0;
+    double growthRate = 0;
+    double waitingGrowthRate = 0;
+
+    // Volume increase in the thoraxic cavity
+    inline void beginTimeStep(double V_ip) {
         double oldV_ip = lungPrm.V_ip;
-        lungPrm.V_ip = q->V_ip;
+        lungPrm.V_ip = V_ip;
 
         // Pressure change caused by the volume increase in the thoraxic cavity
         lungPrm.P_ip = (lungPrm.P_ip + 1)* oldV_ip / lungPrm.V_ip - 1.;
+    }
 
-        double oldV = lungPrm.V;
-
-        // Update the volume of the alveolar branches
-        // Only use asyncUpdateBranches(q) if you are certain, that the model
-        // supports asynchronous updates.
-        updateBranches(q);
-
+    // Everything after the branch update, -oldV- is the volume before the step
+    inline void finishTimeStep(double oldV, double volumeChange) {
+        // Calculate new volume from the volume change of all the branches
+        lungPrm.V += volumeChange;
+        if (volumeCheckRate > 0 && (functionalPrm.timeSteps + 1) % volumeCheckRate == 0) updateVolume();
+        updateLungParameters(oldV);
 
-        // Calculate new volume from the new volume of all the branches
-        updateVolume();
+        // A history event will only create a history entry based on the historyTrackingRate.
+        // This behaviour can be overriden by simply setting the historyTrackingRate = 1
+        // and only calling triggerHistoryEvent() when an entry should be created
+        triggerHistoryEvent();
+    }
 
+    // The lung parameters after the volume changed from -oldV- to the current volume
+    inline void updateLungParameters(double oldV) {
+        LUNG_PROFILE_PHASE(profiler, ProfilePhase::LungUpdate);
         // Pressure change in the alveoli caused by the volume change
         lungPrm.P = (lungPrm.P + 1) * oldV / lungPrm.V - 1.;
 
@@ -78,11 +120,361 @@ public:
 
         // Flow into the lungs equillibrates pressure
         lungPrm.P += lungPrm.q*externPrm.dt / lungPrm.V;
+    }
 
-        // A history event will only create a history entry based on the historyTrackingRate.
-        // This behaviour can be overriden by simply setting the historyTrackingRate = 1
-        // and only calling triggerHistoryEvent() when an entry should be created
-        triggerHistoryEvent();
+    // The loop of run(), the history and volume checks count down instead of
+    // checking the step number every step, otherwise this is timeStep()
+    template <class Waveform, class Update>
+    void runSteps(int nSteps, Waveform&& V_ip, Update&& updateBranches) {
+        int historyRate = Policy::hasHistory ? functionalPrm.historyTrackingRate : 0;
+        int untilHistory = historyRate > 0 ? historyRate - functionalPrm.timeSteps % historyRate : -1;
+        int untilVolumeCheck = volumeCheckRate > 0 ? volumeCheckRate - functionalPrm.timeSteps % volumeCheckRate : -1;
+        int checkpointRate = functionalPrm.checkpointRate;
+        int untilCheckpoint = checkpointRate > 0 ? checkpointRate - functionalPrm.timeSteps % checkpointRate : -1;
+
+        TimeStepParameters q;
+        for (int n = 0; n < nSteps; n++) {
+            q.V_ip = V_ip(functionalPrm.timeSteps);
+            beginTimeStep(q.V_ip);
+            double oldV = lungPrm.V;
+            {
+                LUNG_PROFILE_PHASE(profiler, ProfilePhase::UpdateBranches);
+                lungPrm.V += updateBranches(&q);
+            }
+            if (--untilVolumeCheck == 0) { updateVolume(); untilVolumeCheck = volumeCheckRate; }
+            updateLungParameters(oldV);
+
+            functionalPrm.timeSteps++;
+            LUNG_PROFILE_STEP(profiler);
+            endObservedStep();
+            if (--untilHistory == 0) { recordHistoryEvent(); untilHistory = historyRate; }
+            if (--untilCheckpoint == 0) { super::writePeriodicCheckpoint(); untilCheckpoint = checkpointRate; }
+        }
+    }
+
+    // Looks at the branches on the frontier with the pressure difference -dP-:
+    // how many steps the growing branches need to open, the smallest difference
+    // to the threshold of a growing branch, the smallest threshold of the
+    // other branches and the growth rates of both. Without -predict-
+    // only the smallest threshold is needed.
+    void predictFrontier(double dP, bool predict = true) {
+        frontierThreshold = INFINITY;
+        stepsToOpen = INFINITY;
+        smallestGrowingDifference = INFINITY;
+        smallestWaitingThreshold = INFINITY;
+        growthRate = 0;
+        waitingGrowthRate = 0;
+        for (int i : frontier) {
+            BinaryTreeLungBranch& branch = branches[i];
+            BranchParameters* prm = branch._getBranchParameters();
+            frontierThreshold = std::min<double>(frontierThreshold, prm->P_th);
+            if (!predict) continue;
+
+            double difference = dP - prm->P_th;
+            double rate = branch._getGlobalParameters()->zeta * pow(prm->T, 3) * prm->R;
+            if (difference > 0) {
+                stepsToOpen = std::min(stepsToOpen, (prm->V_max - prm->V) / (rate * difference * externPrm.dt));
+                smallestGrowingDifference = std::min(smallestGrowingDifference, difference);
+                growthRate += rate * super::getMultiplicity(i);
+            }
+            else {
+                smallestWaitingThreshold = std::min<double>(smallestWaitingThreshold, prm->P_th);
+                waitingGrowthRate += rate * super::getMultiplicity(i);
+            }
+        }
+    }
+
+    // The error of a macro step against its single steps, to first order. In
+    // step n of the macro step a growing branch grows by rate * dt * (dP_n - dP_0)
+    // too little (or too much), -drift- is the sum of |dP_n - dP_0|. A waiting
+    // branch misses rate * dt * (dP_n - P_th) once dP_n crosses its threshold,
+    // -excess- is the sum of dP_n - smallestWaitingThreshold over those steps.
+    // The error of P follows from that of V, as P + 1 scales with 1 / V.
+    double macroStepError(double drift, double excess) {
+        double errorOfV = externPrm.dt * (growthRate * drift + waitingGrowthRate * excess);
+        return errorOfV * std::max(1.0, (1 + fabs(lungPrm.P)) / lungPrm.V);
+    }
+
+    // The number of steps the next macro step may take, see advance(). The
+    // change of the pressure difference over the macro step is predicted from
+    // the change of P in the last step and the exact P_ip of the coming steps:
+    // (P_ip + 1) * V_ip stays the same from step to step. The predicted error
+    // has to stay below -rateOfError- per step and below the -budget- left.
+    // No branch may open before the end of the macro step, a rise of the
+    // pressure difference by c speeds up the growth of every branch by at most
+    // 1 + c / smallestGrowingDifference. The length is at most doubled from
+    // one macro step to the next.
+    template <class Waveform>
+    int macroStepLength(int limit, double changeOfP, double rateOfError, double budget, Waveform&& V_ip) {
+        double limitOfSteps = std::min<double>(limit, stepsToOpen);
+        double invariant = (lungPrm.P_ip + 1) * lungPrm.V_ip;
+        double dP = lungPrm.P - lungPrm.P_ip;
+        double drift = 0, excess = 0, rise = 0;
+        int steps = 1;
+        while (2 * steps <= limitOfSteps) {
+            int candidate = 2 * steps;
+            double candidateDrift = drift, candidateExcess = excess, candidateRise = rise;
+            for (int k = steps; k < candidate; k++) {
+                double P_ip = invariant / V_ip(functionalPrm.timeSteps + k) - 1;
+                double change = changeOfP * k + lungPrm.P_ip - P_ip;
+                candidateDrift += fabs(change);
+                candidateExcess += std::max(0.0, dP + change - smallestWaitingThreshold);
+                candidateRise = std::max(candidateRise, change);
+            }
+            if (candidate > limitOfSteps / (1 + candidateRise / smallestGrowingDifference)) break;
+            if (macroStepError(candidateDrift, candidateExcess) > std::min(budget, rateOfError * candidate)) break;
+            drift = candidateDrift;
+            excess = candidateExcess;
+            rise = candidateRise;
+            steps = candidate;
+        }
+        return steps;
+    }
+
+    // Updates the frontier with -steps- steps at once
+    double macroStepBranches(TimeStepParameters* q, int steps) {
+        LUNG_PROFILE_PHASE(profiler, ProfilePhase::UpdateBranches);
+        LUNG_PROFILE_VISITED(profiler, frontier.size());
+        prepareObservables();
+        ExternalParameters macroPrm = externPrm;
+        macroPrm.dt = steps * externPrm.dt;
+        ExactSum volumeChange;
+        for (int k = (int)frontier.size() - 1; k >= 0; k--)
+            updateBranch(volumeChange, frontier[k], q, 0, &macroPrm);
+        updateFrontier();
+        return volumeChange.get();
+    }
+
+    void updateVolume() {
+        LUNG_PROFILE_PHASE(profiler, ProfilePhase::UpdateVolume);
+        // This updates the volume of the lung by adding up all the volumes of the branches,
+        // a branch of a compressed lung counts for all the branches it stands for.
+        // The sum is exact, so it does not depend on the order of the branches
+        // or on how the compiler vectorizes it.
+        double V = 0;
+        if (useArrays) V = branchArrays.volume();
+        else {
+            ExactSum sum;
+            for (size_t i = 0; i < branches.size(); i++) sum.add(branches[i]._getBranchParameters()->V, super::getMultiplicity(int(i)));
+            V = sum.get();
+        }
+
+        volumeDrift = std::max(volumeDrift, fabs(V - lungPrm.V));
+        lungPrm.V = V;
+    }
+
+    // This is the branch update on the structure of arrays, it does exactly
+    // the same as BinaryTreeLungBranch::timeStep for all branches. Both round
+    // V + k * d * dt with multiplyAdd(), so the results are the same bit for
+    // bit, unless -ffast-math lets the compiler rearrange them differently.
+    // See ./check/check.cpp.
+    double updateBranchArrays() {
+        compactBranches();
+        prepareObservables();
+        if (branchArraysVersion != topologyVersion) {
+            branchArrays.gather(branches, multiplicity);
+            branchArraysVersion = topologyVersion;
+        }
+        // The kernel hands the changed branches to the observables
+        branchArrays.observables = observables.isActive() ? &observables : nullptr;
+
+        double dP = lungPrm.P - lungPrm.P_ip;
+        double dt = externPrm.dt;
+        LUNG_PROFILE_VISITED(profiler, branchArrays.size());
+        ExactSum volumeChange;
+        bool threaded = false;
+        if constexpr (Policy::hasThreading) {
+            threaded = functionalPrm.useMultithreading > 1;
+            if (threaded) {
+                for (auto& partial : threadSums) partial.sum = ExactSum();
+                LUNG_PROFILE_PARALLEL_BEGIN(profiler, threadPool.size());
+                threadPool.parallelFor(branchArrays.size(), functionalPrm.threadingGrain, [&](size_t N_min, size_t N_max, int thread) {
+                    LUNG_PROFILE_CHUNK(profiler, thread);
+                    LUNG_PROFILE_OPENED(profiler, thread, branchArrays.timeStep(N_min, N_max, dP, dt, threadSums[thread].sum, thread));
+                });
+                LUNG_PROFILE_PARALLEL_END(profiler);
+                for (auto& partial : threadSums) volumeChange.add(partial.sum);
+            }
+        }
+        if (!threaded) LUNG_PROFILE_OPENED(profiler, 0, branchArrays.timeStep(0, branchArrays.size(), dP, dt, volumeChange));
+        branchArrays.finishTimeStep();
+        return volumeChange.get();
+    }
+
+public:
+    // These are the initializers they will call the initializer of the base class
+    BinaryTreeLungModel(GlobalBranchParameters branch_prm, ExternalParameters extern_prm) : super(branch_prm, extern_prm) { init(); };
+    BinaryTreeLungModel(ExternalParameters extern_prm) : super(extern_prm) { init(); };
+
+    using super::compactBranches;
+
+    // Keep the state of the branches in contiguous arrays and update them with a
+    // vectorized kernel instead of calling the time step of every branch. The
+    // branch objects are only brought up to date by synchronizeBranches(), which
+    // the framework calls before it reads them (e.g. for the detailed history).
+    void useStructureOfArrays(bool enable = true) {
+        if (!enable) synchronizeBranches();
+        useArrays = enable;
+        branchArraysVersion = -1;
+    };
+
+    // Writes the state of the structure of arrays back into the branches, call
+    // this before reading the branches directly.
+    void synchronizeBranches() override {
+        if (useArrays && branchArraysVersion == topologyVersion) branchArrays.scatter(branches);
+    };
+
+    // The volume of the lung is updated with the volume changes the branches
+    // report during their update. Every -rate- steps the volume is summed up over
+    // all branches instead, which resets rounding drift and records the biggest
+    // difference seen so far in _getVolumeDrift(). A rate of 0 turns this off.
+    void checkVolumeDrift(int rate) { volumeCheckRate = rate; };
+    double _getVolumeDrift() { return volumeDrift; };
+
+    // This is the "global" time step for the lung
+    // Realization of the simple binary tree model on the lung level
+    inline void timeStep(TimeStepParameters* q) override
+    {
+        beginTimeStep(q->V_ip);
+        double oldV = lungPrm.V;
+
+        // Update the volume of the alveolar branches
+        // Only use asyncUpdateBranches(q) if you are certain, that the model
+        // supports asynchronous updates. The branches of this model read the
+        // state of their parent, so with threading enabled they are updated
+        // layer by layer, which gives the same results as the serial update.
+        double volumeChange;
+        {
+            LUNG_PROFILE_PHASE(profiler, ProfilePhase::UpdateBranches);
+            if (useArrays) volumeChange = updateBranchArrays();
+            else if (functionalPrm.frontierStepping) volumeChange = frontierUpdateBranches(q);
+            else if (functionalPrm.useMultithreading > 1) volumeChange = levelSynchronousUpdateBranches(q);
+            else volumeChange = updateBranches(q);
+        }
+
+        finishTimeStep(oldV, volumeChange);
+    };
+
+    // This runs -nSteps- time steps, step n uses -V_ip[n]-. It does the same as
+    // calling timeStep() for every step, but the choice of the branch update
+    // is made once and the steps run in one loop without any virtual calls.
+    void run(int nSteps, const double* V_ip) {
+        int first = functionalPrm.timeSteps;
+        run(nSteps, [&](int step) { return V_ip[step - first]; });
+    }
+
+    void run(int nSteps, const TimeStepParameters* q) override {
+        int first = functionalPrm.timeSteps;
+        run(nSteps, [&](int step) { return q[step - first].V_ip; });
+    }
+
+    // Same as above, -V_ip(step)- gives the intrapleural volume of every step
+    // (counted like the history, starting at 0 for the first step of the lung)
+    template <class Waveform, class = std::enable_if_t<std::is_invocable_v<Waveform&, int>>>
+    void run(int nSteps, Waveform&& V_ip) {
+        if (useArrays) runSteps(nSteps, V_ip, [&](TimeStepParameters*) { return updateBranchArrays(); });
+        else if (functionalPrm.frontierStepping) runSteps(nSteps, V_ip, [&](TimeStepParameters* q) { return super::frontierUpdateBranches(q); });
+        else if (functionalPrm.useMultithreading > 1) runSteps(nSteps, V_ip, [&](TimeStepParameters* q) { return super::levelSynchronousUpdateBranches(q); });
+        else runSteps(nSteps, V_ip, [&](TimeStepParameters* q) { return super::updateBranches(q); });
+    }
+
+    // This advances the lung by -nSteps- steps, where -V_ip(step)- gives the
+    // intrapleural volume of every step (counted like the history, starting
+    // at 0 for the first step of the lung).
+    //
+    // Most of the time the pressure difference is below the threshold of every
+    // branch that could still open, then no branch changes and the step only
+    // updates the handful of lung parameters, without touching any branch. This
+    // is exact, with -tolerance- = 0 the results are the same as those of
+    // timeStep().
+    //
+    // With -tolerance- > 0 the steps in which branches grow are merged into
+    // macro steps as well: the branches grow over several steps at once with the
+    // pressure difference of the first one, while the lung parameters still go
+    // through every step. A macro step is never longer than the time until the
+    // next branch is predicted to open. The error of every macro step against
+    // its single steps is estimated (see macroStepError()), before the step
+    // from the predicted pressure differences to choose its length and after
+    // it from the ones the lung went through. Half of -tolerance- is spread
+    // evenly over the -nSteps- steps, the other half is left for the errors the
+    // macro steps cause in the steps after them. Once the estimates used up
+    // their half, the remaining steps are exact. So P and V stay within
+    // -tolerance- of the results of timeStep(), for the steps of this call.
+    template <class Waveform>
+    void advance(int nSteps, Waveform&& V_ip, double tolerance = 0)
+    {
+        // This works on the branch objects and the frontier
+        synchronizeBranches();
+        branchArraysVersion = -1;
+        compactBranches();
+        if (frontierVersion != topologyVersion) buildFrontier();
+        predictFrontier(lungPrm.P - lungPrm.P_ip, false);
+        double budget = tolerance / 2;
+        double rateOfError = nSteps > 0 ? budget / nSteps : 0;
+        // The P of the last step and the length of the last macro step
+        double lastP = NAN;
+        int lastSteps = 1;
+        // After a macro step of a single step the next ones are tried less
+        // and less often, looking at the frontier costs more than a step
+        int retry = 1, untilRetry = 0;
+        for (int n = 0; n < nSteps;) {
+            TimeStepParameters q({.V_ip = V_ip(functionalPrm.timeSteps)});
+            beginTimeStep(q.V_ip);
+            double oldV = lungPrm.V;
+            double dP = lungPrm.P - lungPrm.P_ip;
+
+            // No branch can change in this step, this is compared in the
+            // scalar type of the branches, like they do it
+            typedef BranchParameters::scalar_type Scalar;
+            if (!(Scalar(dP) - Scalar(frontierThreshold) > 0)) {
+                lastP = lungPrm.P;
+                lastSteps = 1;
+                finishTimeStep(oldV, 0);
+                n++;
+                continue;
+            }
+
+            int steps = 1;
+            if (budget > 0 && !std::isnan(lastP) && --untilRetry <= 0) {
+                predictFrontier(dP);
+                steps = macroStepLength(std::min(nSteps - n, 2 * lastSteps), lungPrm.P - lastP, rateOfError, budget, V_ip);
+                retry = steps > 1 ? 1 : std::min(2 * retry, 64);
+                untilRetry = retry;
+            }
+
+            if (steps == 1) {
+                double volumeChange;
+                {
+                    LUNG_PROFILE_PHASE(profiler, ProfilePhase::UpdateBranches);
+                    volumeChange = frontierUpdateBranches(&q);
+                }
+                lastP = lungPrm.P;
+                lastSteps = 1;
+                finishTimeStep(oldV, volumeChange);
+                predictFrontier(dP, false);
+                n++;
+                continue;
+            }
+
+            // The lung parameters go through every step of the macro step, the
+            // volume change of the branches is spread evenly over them
+            double volumeChange = macroStepBranches(&q, steps);
+            double drift = 0, excess = 0;
+            lastP = lungPrm.P;
+            finishTimeStep(oldV, volumeChange / steps);
+            for (int k = 1; k < steps; k++) {
+                beginTimeStep(V_ip(functionalPrm.timeSteps));
+                double dP_k = lungPrm.P - lungPrm.P_ip;
+                drift += fabs(dP_k - dP);
+                excess += std::max(0.0, dP_k - smallestWaitingThreshold);
+                lastP = lungPrm.P;
+                finishTimeStep(lungPrm.V, volumeChange / steps);
+            }
+            budget -= macroStepError(drift, excess);
+            predictFrontier(dP, false);
+            lastSteps = steps;
+            n += steps;
+        }
     };
 
     // Get the N-th branch down the line, only important for some special figures
@@ -92,3 +484,5 @@ public:
         return _getConnectionOfOrder(N-1, branch->_getConnection());
     }
 };
+
+typedef BinaryTreeLungModel<> BinaryTreeLung;
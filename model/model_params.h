@@ -6,6 +6,40 @@
 //  Copyright © 2019 Felix Kratz. All rights reserved.
 //
 
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+
+// The floating point type of the branch parameters. With -DLUNG_SCALAR=float
+// the branches take half the memory and the vectorized branch updates process
+// twice as many branches per instruction. The lung parameters always stay in
+// double, the volume changes of the branches are summed up in double as well.
+// This is a build flag, so it holds for every lung of the program, two lungs
+// of different precision can not be mixed in one build. In double the branch
+// parameters take 56 bytes, in float 28.
+#ifndef LUNG_SCALAR
+#define LUNG_SCALAR double
+#endif
+
+// a * b + c, rounded once if the target has fused multiply adds (e.g. with
+// -march=native) and twice otherwise. The compiler contracts a * b + c on its
+// own only in some places, the branch objects and the vectorized kernels (see
+// branchArrays.h) both use this, so their results are the same bit for bit.
+#if defined(__FMA__) || defined(__FP_FAST_FMA)
+#define LUNG_HAS_FMA 1
+#endif
+
+template <class T>
+inline T multiplyAdd(T a, T b, T c) {
+#ifdef LUNG_HAS_FMA
+    return std::fma(a, b, c);
+#else
+    return a * b + c;
+#endif
+}
+
 struct TimeStepParameters {
     double V_ip;
 };
@@ -25,19 +59,37 @@ struct GlobalBranchParameters {
     double zeta;
 };
 
+// The part of the branch parameters that changes during the simulation, the
+// delta history only stores this for the branches that changed
+template <class Scalar>
+struct BranchStateT {
+    Scalar V;
+    bool isOpen;
+
+    bool operator==(const BranchStateT& other) const { return V == other.V && isOpen == other.isOpen; };
+};
+
 // Parameters that are individual for every branch
-struct BranchParameters {
+template <class Scalar>
+struct BranchParametersT {
+    typedef Scalar scalar_type;
+
     // Branch scale quantities
-    double R;
-    double L;
-    double T;
-    double V;
-    double V_max;
-    double P_th;
+    Scalar R;
+    Scalar L;
+    Scalar T;
+    Scalar V;
+    Scalar V_max;
+    Scalar P_th;
     short layer_ID;
     bool isOpen = false;
     bool isStatic = false;
 
+    // The fields in memory order, this is written into the history files
+    static constexpr const char* schema = std::is_same_v<Scalar, float>
+        ? "float R; float L; float T; float V; float V_max; float P_th; short layer_ID; bool isOpen; bool isStatic"
+        : "double R; double L; double T; double V; double V_max; double P_th; short layer_ID; bool isOpen; bool isStatic";
+
     void validateVolume() {
         if (V >= M_PI * pow(R, 2) * L)
         {
@@ -63,8 +115,18 @@ struct BranchParameters {
             validateVolume();
         setMaxVolume();
     };
+
+    // Branches with the same key behave exactly the same way, this is how
+    // identical subtrees are found, see subtreeCompression.h
+    auto key() const { return std::make_tuple(R, L, T, V, V_max, P_th, layer_ID, isOpen, isStatic); };
+
+    BranchStateT<Scalar> getState() const { return {V, isOpen}; };
+    void setState(const BranchStateT<Scalar>& state) { V = state.V; isOpen = state.isOpen; };
 };
 
+typedef BranchStateT<LUNG_SCALAR> BranchState;
+typedef BranchParametersT<LUNG_SCALAR> BranchParameters;
+
 // Parameters that define the global behaviour of the lung
 struct LungParameters {
     bool inhale = true;
@@ -81,17 +143,22 @@ struct LungParameters {
     double P_ip = 0;
     double V_ip = 0;
 
-    void addBranchAdjustments(BranchParameters* _prm) {
+    // The fields in memory order, this is written into the history files
+    static constexpr const char* schema = "bool inhale; double P; double V; double dP; double q; double V_max; double V_min; double P_ip; double V_ip";
+
+    // A branch of a compressed lung stands for -multiplicity- branches, see
+    // Lung::addCompressedBranches()
+    void addBranchAdjustments(BranchParameters* _prm, uint64_t multiplicity = 1) {
         // Adjust the volume, maxVolume and minVolume to accomodate for the addition of another branch
-        V += _prm->V;
-        V_max += _prm->V_max;
-        if (_prm->isStatic) V_min += _prm->V;
+        V += double(multiplicity) * _prm->V;
+        V_max += double(multiplicity) * _prm->V_max;
+        if (_prm->isStatic) V_min += double(multiplicity) * _prm->V;
     }
 
-    void removeBranchAdjustments(BranchParameters* _prm) {
+    void removeBranchAdjustments(BranchParameters* _prm, uint64_t multiplicity = 1) {
         // Adjust the volume and maxVolume to accomodate for the removal of the branch
-        V -= _prm->V;
-        V_max -= _prm->V_max;
-        if (_prm->isStatic) V_min -= _prm->V;
+        V -= double(multiplicity) * _prm->V;
+        V_max -= double(multiplicity) * _prm->V_max;
+        if (_prm->isStatic) V_min -= double(multiplicity) * _prm->V;
     }
 };
@@ -0,0 +1,263 @@
+//
+//  treeGenerator.h
+//  OpenLung
+//
+//  Created by Felix Kratz on 16.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+#pragma once
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "lung.h"
+
+// This is a random bit generator for the <random> distributions. Every branch
+// gets its own generator, seeded from the seed of the tree and the index of the
+// branch, so the random numbers of a branch do not depend on the order in which
+// the branches are generated or on the number of threads.
+struct BranchRandomEngine {
+    typedef uint64_t result_type;
+    uint64_t state;
+
+    BranchRandomEngine(uint64_t seed, uint64_t index, uint64_t stream) {
+        state = seed;
+        state = mix(state ^ (index * 0x9E3779B97F4A7C15ull));
+        state = mix(state ^ (stream * 0xD1B54A32D192ED03ull));
+    };
+
+    static constexpr result_type min() { return 0; };
+    static constexpr result_type max() { return ~result_type(0); };
+
+    // splitmix64
+    inline result_type operator()() {
+        state += 0x9E3779B97F4A7C15ull;
+        return mix(state);
+    };
+
+    static inline uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    };
+};
+
+// A normal distribution of a branch parameter, values below zero are drawn
+// again. A standard deviation of 0 always gives the mean.
+struct ParameterDistribution {
+    double mean = 0;
+    double sd = 0;
+
+    template <class Engine>
+    double sample(Engine& engine) const {
+        if (sd <= 0) return mean;
+        std::normal_distribution<double> distribution(mean, sd);
+        double value;
+        do value = distribution(engine); while (value < 0);
+        return value;
+    };
+};
+
+// The parameters of the branches of one generation of the tree. Every branch
+// of the previous generation splits into -children- branches of this
+// generation, unless it terminates with -terminationProbability-, which gives
+// asymmetric trees. The root never terminates.
+struct GenerationParameters {
+    ParameterDistribution R;
+    ParameterDistribution L;
+    ParameterDistribution T;
+    ParameterDistribution P_th;
+    int children = 2;
+    double terminationProbability = 0;
+};
+
+// This builds a tree generation by generation: the number of children of
+// every branch is drawn in parallel, a prefix sum over them gives the index of
+// every child, and then the children are drawn in parallel right into their
+// place in one contiguous table, which is added to the lung in one go. The
+// branches end up in breadth first order and the tree is the same for any
+// number of threads.
+class TreeGenerator {
+public:
+    // -root- is the first branch (e.g. the static trachea), -generations[g]-
+    // describes the branches of generation g + 1
+    TreeGenerator(BranchParameters root, std::vector<GenerationParameters> generations, uint64_t seed = 0)
+        : root(root), generations(generations), seed(seed) {};
+
+    void useThreading(int threadCount = 4, int grain = 4096) {
+        threadPool.resize(threadCount);
+        this->grain = grain;
+    };
+
+    // Adds the generated tree to the lung, the root connects to nothing
+    template <class Lung>
+    void generate(Lung& lung) {
+        build();
+        lung.addBranches(branchParams.data(), branchParams.size(), connectionBegin.data(), parents.data());
+    };
+
+    template <class Lung>
+    void generate(Lung& lung, GlobalBranchParameters* _branch_prm_global) {
+        build();
+        lung.addBranches(branchParams.data(), branchParams.size(), connectionBegin.data(), parents.data(), _branch_prm_global);
+    };
+
+    // Adds the generated tree compressed to the lung, see
+    // Lung::addCompressedBranches(). If no parameter of any generation is
+    // random, every generation is one branch and the full tree is never built.
+    template <class Lung>
+    void generateCompressed(Lung& lung) {
+        if (buildCompressed()) lung.addCompressedBranches(compressed);
+    };
+
+    template <class Lung>
+    void generateCompressed(Lung& lung, GlobalBranchParameters* _branch_prm_global) {
+        if (buildCompressed()) lung.addCompressedBranches(compressed, _branch_prm_global);
+    };
+
+    size_t size() const { return branchParams.size(); };
+    const CompressedTree& _getCompressedTree() const { return compressed; };
+
+    // The tables of the last generated tree, the connections are in the format
+    // of Lung::addBranches(): the root has no connection, every other branch
+    // has its parent as its only connection
+    const BranchParameters* _getBranchParameters() const { return branchParams.data(); };
+    const uint64_t* _getConnectionBegin() const { return connectionBegin.data(); };
+    const int32_t* _getConnections() const { return parents.data(); };
+
+private:
+    // Every branch draws from its own streams, see BranchRandomEngine
+    enum Stream : uint64_t { childStream = 1, parameterStream = 2 };
+
+    BranchParameters root;
+    std::vector<GenerationParameters> generations;
+    uint64_t seed;
+
+    ThreadPool threadPool;
+    size_t grain = 4096;
+
+    std::vector<BranchParameters> branchParams;
+    // parents[i - 1] is the parent of branch i
+    std::vector<int32_t> parents;
+    std::vector<uint64_t> connectionBegin;
+
+    CompressedTree compressed;
+
+    bool isSymmetric() const {
+        for (size_t g = 0; g < generations.size(); g++) {
+            const GenerationParameters& generation = generations[g];
+            if (generation.R.sd > 0 || generation.L.sd > 0 || generation.T.sd > 0 || generation.P_th.sd > 0) return false;
+            if (g > 0 && generation.terminationProbability > 0) return false;
+        }
+        return true;
+    };
+
+    bool buildCompressed() {
+        if (!isSymmetric()) {
+            build();
+            return compressSubtrees(branchParams.size(), [&](size_t i) -> const BranchParameters& { return branchParams[i]; },
+                                    connectionBegin.data(), parents.data(), compressed);
+        }
+
+        // Every generation is one branch that stands for all of its branches,
+        // drawn exactly like build() does it
+        branchParams.clear();
+        parents.clear();
+        connectionBegin.clear();
+        compressed.clear();
+        BranchParameters first = root;
+        first.layer_ID = 0;
+        int32_t parent = compressed.add(first, BranchConnectivity::none, 1);
+        uint64_t count = 1;
+        for (size_t g = 0; g < generations.size() && generations[g].children > 0; g++) {
+            const GenerationParameters& generation = generations[g];
+            count *= generation.children;
+            BranchRandomEngine engine(seed, 0, parameterStream);
+            BranchParameters prm = BranchParameters();
+            prm.R = generation.R.sample(engine);
+            prm.L = generation.L.sample(engine);
+            prm.T = generation.T.sample(engine);
+            prm.P_th = generation.P_th.sample(engine);
+            prm.V = 0;
+            prm.layer_ID = short(g + 1);
+            parent = compressed.add(prm, parent, count);
+        }
+        return true;
+    };
+
+    void build() {
+        branchParams.assign(1, root);
+        branchParams[0].layer_ID = 0;
+        parents.clear();
+
+        std::vector<uint64_t> offsets;
+        size_t first = 0, end = 1;
+        for (size_t g = 0; g < generations.size() && end > first; g++) {
+            const GenerationParameters& generation = generations[g];
+            size_t count = end - first;
+
+            // The children of every branch of the previous generation
+            offsets.resize(count + 1);
+            threadPool.parallelFor(count, grain, [&](size_t begin, size_t last, int) {
+                for (size_t k = begin; k < last; k++) {
+                    BranchRandomEngine engine(seed, first + k, childStream);
+                    bool terminates = generation.terminationProbability > 0 && g > 0
+                        && std::uniform_real_distribution<double>(0, 1)(engine) < generation.terminationProbability;
+                    offsets[k] = terminates ? 0 : generation.children;
+                }
+            });
+            size_t children = exclusiveScan(offsets, count);
+
+            // Draw the children straight into their place
+            branchParams.resize(end + children);
+            parents.resize(end + children - 1);
+            threadPool.parallelFor(count, grain, [&](size_t begin, size_t last, int) {
+                for (size_t k = begin; k < last; k++) {
+                    for (uint64_t c = offsets[k]; c < offsets[k + 1]; c++) {
+                        size_t index = end + c;
+                        BranchRandomEngine engine(seed, index, parameterStream);
+                        BranchParameters& prm = branchParams[index];
+                        prm = BranchParameters();
+                        prm.R = generation.R.sample(engine);
+                        prm.L = generation.L.sample(engine);
+                        prm.T = generation.T.sample(engine);
+                        prm.P_th = generation.P_th.sample(engine);
+                        prm.V = 0;
+                        prm.layer_ID = short(g + 1);
+                        parents[index - 1] = int32_t(first + k);
+                    }
+                }
+            });
+            first = end;
+            end += children;
+        }
+
+        connectionBegin.resize(branchParams.size() + 1);
+        connectionBegin[0] = 0;
+        for (size_t i = 1; i <= branchParams.size(); i++) connectionBegin[i] = i - 1;
+    };
+
+    // Turns -values[0, count)- into their exclusive prefix sum, values[count]
+    // becomes the total. Every thread sums up its chunk first, then the
+    // chunks are offset by the sums of the chunks before them.
+    size_t exclusiveScan(std::vector<uint64_t>& values, size_t count) {
+        size_t chunks = (count + grain - 1) / grain;
+        std::vector<uint64_t> chunkSums(chunks + 1, 0);
+        threadPool.parallelFor(count, grain, [&](size_t begin, size_t last, int) {
+            uint64_t sum = 0;
+            for (size_t k = begin; k < last; k++) sum += values[k];
+            chunkSums[begin / grain + 1] = sum;
+        });
+        for (size_t c = 1; c <= chunks; c++) chunkSums[c] += chunkSums[c - 1];
+        threadPool.parallelFor(count, grain, [&](size_t begin, size_t last, int) {
+            uint64_t sum = chunkSums[begin / grain];
+            for (size_t k = begin; k < last; k++) {
+                uint64_t value = values[k];
+                values[k] = sum;
+                sum += value;
+            }
+        });
+        values[count] = chunkSums[chunks];
+        return values[count];
+    };
+};
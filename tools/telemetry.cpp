@@ -0,0 +1,143 @@
+//
+//  telemetry.cpp
+//  OpenLung
+//
+//  Created by Felix Kratz on 17.10.26.
+//  Copyright © 2026 Felix Kratz. All rights reserved.
+//
+
+// This tails the telemetry of a running simulation, see
+// Lung::publishTelemetry(). Every record is printed as one line with the
+// step, the time, the lung parameters and the published observables. The
+// tool only reads the shared memory, the simulation never waits for it.
+//
+// Run it with "make telemetry TELEMETRY_ARGS='/lung --columns V.layer3'",
+// see usage() for all options.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "telemetry.h"
+
+struct TelemetryOptions {
+    std::string name;
+    std::vector<std::string> columns;
+    int interval = 100;
+    bool latest = false;
+    bool once = false;
+    bool wait = false;
+    bool remove = false;
+};
+
+static void usage() {
+    printf("usage: telemetry <name> [options]\n"
+           "  --columns a,b,...   only print these observables (default: all)\n"
+           "  --interval <ms>     time between two looks at the segment (default: 100)\n"
+           "  --latest            only print the newest record every interval\n"
+           "  --once              print the newest record and exit\n"
+           "  --wait              wait for the next run if the segment is from a finished one\n"
+           "  --remove            remove the segment once the simulation finished\n");
+}
+
+static bool parseOptions(int argc, char** argv, TelemetryOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--columns" && hasValue) {
+            std::stringstream list(argv[++i]);
+            std::string column;
+            while (std::getline(list, column, ',')) if (!column.empty()) options.columns.push_back(column);
+        }
+        else if (arg == "--interval" && hasValue) options.interval = std::max(1, atoi(argv[++i]));
+        else if (arg == "--latest") options.latest = true;
+        else if (arg == "--once") options.once = true;
+        else if (arg == "--wait") options.wait = true;
+        else if (arg == "--remove") options.remove = true;
+        else if (arg[0] != '-' && options.name.empty()) options.name = arg;
+        else return false;
+    }
+    if (options.name.empty()) return false;
+    if (options.name[0] != '/') options.name = "/" + options.name;
+    return true;
+}
+
+static void printHeader(const std::vector<std::string>& columns, const std::vector<int>& selected) {
+    printf("%10s %12s %14s %14s %14s %14s %14s", "step", "t", "P", "V", "q", "P_ip", "V_ip");
+    for (int c : selected) printf(" %14s", columns[c].c_str());
+    printf("\n");
+}
+
+static void printRecord(const TelemetryRecord& record, double dt, const std::vector<int>& selected) {
+    const LungParameters& prm = record.lungPrm;
+    printf("%10lld %12.6g %14.6g %14.6g %14.6g %14.6g %14.6g", (long long)record.step, record.step * dt, prm.P, prm.V, prm.q, prm.P_ip, prm.V_ip);
+    for (int c : selected) printf(" %14.6g", record.values[c]);
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    TelemetryOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+
+    // The simulation might not have published its first record yet, the
+    // segment of a finished run stays until it is removed or replaced
+    TelemetryReader reader;
+    while (!reader.open(options.name) || (options.wait && reader.isFinished())) {
+        if (options.once && !reader.isOpen()) {
+            printf("ERROR: There is no telemetry %s\n", options.name.c_str());
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(options.interval));
+    }
+
+    const std::vector<std::string>& columns = reader.getColumns();
+    std::vector<int> selected;
+    for (size_t c = 0; c < columns.size(); c++)
+        if (options.columns.empty() || std::find(options.columns.begin(), options.columns.end(), columns[c]) != options.columns.end())
+            selected.push_back(int(c));
+    if (selected.size() < options.columns.size()) printf("WARNING: Not all columns are published by the simulation\n");
+    printf("# telemetry %s of process %d, every %d steps\n", options.name.c_str(), reader.getPid(), reader.getRate());
+    printHeader(columns, selected);
+
+    TelemetryRecord record;
+    if (options.once) {
+        if (reader.readLatest(record)) printRecord(record, reader.getDt(), selected);
+        return 0;
+    }
+
+    // The next record to print
+    uint64_t next = reader.getOldestRecord();
+    while (true) {
+        bool finished = reader.isFinished();
+        uint64_t published = reader.getPublishedCount();
+        if (options.latest) {
+            if (published > next && reader.readLatest(record)) printRecord(record, reader.getDt(), selected);
+            next = published;
+        }
+        for (; next < published; next++) {
+            if (reader.read(next, record)) {
+                printRecord(record, reader.getDt(), selected);
+                continue;
+            }
+            // The simulation lapped us, go on with the oldest record left
+            uint64_t oldest = reader.getOldestRecord();
+            printf("# lost %llu records\n", (unsigned long long)(std::max(oldest, next + 1) - next));
+            next = std::max(oldest, next + 1) - 1;
+        }
+        if (finished) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(options.interval));
+    }
+
+    printf("# finished after %llu records\n", (unsigned long long)next);
+    if (options.remove) removeTelemetry(options.name);
+    return 0;
+}